@@ -2,11 +2,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "y64sim.h"
 
+#define MAX_LINE 1024
+
+/* Messages go to the output of the run in this thread, see run_file() */
+static __thread FILE *msg_out;
+
 #define err_print(_s, _a ...) \
-    fprintf(stdout, _s"\n", _a);
+    fprintf(msg_out ? msg_out : stdout, _s"\n", _a);
 
 
 typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
@@ -47,23 +56,138 @@ bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest)
     return TRUE;
 }
 
+/*
+ * mem_read: whether the n <= 8 bytes at addr are in memory. Loads
+ *     mostly stay on the page last written (the stack), which is known
+ *     to be whole and in range, so they skip the bounds check.
+ */
+static inline bool_t mem_read(mem_t *m, long_t addr, long_t n)
+{
+    /* unsigned, so no negative address maps to the empty TLB's -1 */
+    if ((long_t)((uint64_t)addr >> MEM_PAGE_SHIFT) == m->tlb &&
+        (long_t)((uint64_t)(addr + n - 1) >> MEM_PAGE_SHIFT) == m->tlb)
+        return TRUE;
+    return addr >= 0 && addr + n <= m->len;
+}
+
 bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
 {
-    int i;
-    long_t val;
-    if (addr < 0 || addr + 8 > m->len)
+    if (!mem_read(m, addr, 8))
 	    return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++)
-	    val = val | ((long_t)m->data[addr+i])<<(8*i);
-    *dest = val;
+    memcpy(dest, m->data + addr, 8);
     return TRUE;
 }
 
+/*
+ * sparse_alloc: n zero bytes of address space, backed only where touched
+ */
+static void *sparse_alloc(size_t n)
+{
+    void *p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap() of 0x%lx bytes failed\n", (unsigned long)n);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * page_alloc: zeroed records of size bytes for the addresses of one page.
+ *     Tables that only matter where code runs hold one such block per
+ *     page, allocated when the page first runs, so they cost what the
+ *     program executes rather than what -m reserves.
+ */
+static void *page_alloc(size_t size)
+{
+    void *p = calloc(MEM_PAGE_SIZE, size);
+
+    if (!p) {
+        fprintf(stderr, "calloc() of 0x%lx bytes failed\n",
+                (unsigned long)MEM_PAGE_SIZE * size);
+        exit(1);
+    }
+    return p;
+}
+
+/* Append i to a growing list */
+static void add_index(int **list, int *n, int *max, int i)
+{
+    if (*n == *max) {
+        *max = *max ? 2 * *max : 16;
+        *list = (int *)realloc(*list, *max * sizeof(int));
+    }
+    (*list)[(*n)++] = i;
+}
+
+/* Bytes of memory in page; the last one may be short */
+static inline long_t page_bytes(mem_t *m, long_t page)
+{
+    long_t addr = page << MEM_PAGE_SHIFT;
+    return m->len - addr < MEM_PAGE_SIZE ? m->len - addr : MEM_PAGE_SIZE;
+}
+
+/* Keep a saved page copy for reuse */
+static void add_spare(mem_t *m, byte_t *copy)
+{
+    if (m->n_spare == m->max_spare) {
+        m->max_spare = m->max_spare ? 2 * m->max_spare : 16;
+        m->spare = (byte_t **)realloc(m->spare, m->max_spare * sizeof(byte_t *));
+    }
+    m->spare[m->n_spare++] = copy;
+}
+
+/*
+ * write_pages: get the pages of [addr, addr + n) ready to be written:
+ *     flag them as touched and dirty, and under a snapshot save what
+ *     they hold first (copy on write)
+ */
+static void write_pages(mem_t *m, long_t addr, long_t n)
+{
+    long_t page;
+    byte_t *copy;
+
+    for (page = addr >> MEM_PAGE_SHIFT;
+         page <= (addr + n - 1) >> MEM_PAGE_SHIFT; page++) {
+        if (m->dirty[page])
+            continue;
+        if (!m->touched[page]) {
+            m->touched[page] = 1;
+            add_index(&m->pages, &m->n_pages, &m->max_pages, page);
+        }
+        m->dirty[page] = 1;
+        add_index(&m->dirty_pages, &m->n_dirty, &m->max_dirty, page);
+        if (m->snapped) {
+            copy = m->n_spare ? m->spare[--m->n_spare]
+                              : (byte_t *)malloc(MEM_PAGE_SIZE);
+            memcpy(copy, m->data + (page << MEM_PAGE_SHIFT),
+                   page_bytes(m, page));
+            m->saved[page] = copy;
+        }
+    }
+    /* a short last page would let mem_read() pass the end of memory */
+    page = (addr + n - 1) >> MEM_PAGE_SHIFT;
+    m->tlb = page_bytes(m, page) == MEM_PAGE_SIZE ? page : -1;
+}
+
+/*
+ * mem_write: call before storing n <= 8 bytes at addr. Stores mostly
+ *     stay on the page of the one before, which needs no look at the
+ *     flags.
+ */
+static inline void mem_write(mem_t *m, long_t addr, long_t n)
+{
+    if ((addr >> MEM_PAGE_SHIFT) != m->tlb ||
+        ((addr + n - 1) >> MEM_PAGE_SHIFT) != m->tlb)
+        write_pages(m, addr, n);
+}
+
 bool_t set_byte_val(mem_t *m, long_t addr, byte_t val)
 {
     if (addr < 0 || addr >= m->len)
 	    return FALSE;
+    mem_write(m, addr, 1);
     m->data[addr] = val;
     return TRUE;
 }
@@ -73,6 +197,7 @@ bool_t set_long_val(mem_t *m, long_t addr, long_t val)
     int i;
     if (addr < 0 || addr + 8 > m->len)
 	    return FALSE;
+    mem_write(m, addr, 8);
     for (i = 0; i < 8; i++) {
     	m->data[addr+i] = val & 0xFF;
     	val >>= 8;
@@ -80,48 +205,193 @@ bool_t set_long_val(mem_t *m, long_t addr, long_t val)
     return TRUE;
 }
 
+/*
+ * init_mem: a zeroed memory of len bytes. The whole range is mapped at
+ *     once, but the kernel only supplies (zero-filled) pages as they are
+ *     first touched, so a large memory costs what the program uses.
+ */
 mem_t *init_mem(int len)
 {
     mem_t *m = (mem_t *)malloc(sizeof(mem_t));
     len = ((len+BLK_SIZE-1)/BLK_SIZE)*BLK_SIZE;
     m->len = len;
-    m->data = (byte_t *)calloc(len, 1);
+    m->data = (byte_t *)sparse_alloc(len);
+    m->touched = (byte_t *)calloc((len >> MEM_PAGE_SHIFT) + 1, 1);
+    m->pages = NULL;
+    m->n_pages = m->max_pages = 0;
+    m->dirty = (byte_t *)calloc((len >> MEM_PAGE_SHIFT) + 1, 1);
+    m->dirty_pages = NULL;
+    m->n_dirty = m->max_dirty = 0;
+    m->snapped = FALSE;
+    m->saved = NULL;
+    m->spare = NULL;
+    m->n_spare = m->max_spare = 0;
+    m->tlb = -1;
 
     return m;
 }
 
 void free_mem(mem_t *m)
 {
-    free((void *) m->data);
+    int i;
+
+    if (m->saved) {
+        for (i = 0; i < m->n_dirty; i++)
+            free(m->saved[m->dirty_pages[i]]);
+        munmap(m->saved, ((m->len >> MEM_PAGE_SHIFT) + 1) * sizeof(byte_t *));
+    }
+    for (i = 0; i < m->n_spare; i++)
+        free(m->spare[i]);
+    munmap(m->data, m->len);
+    free((void *) m->touched);
+    free((void *) m->pages);
+    free((void *) m->dirty);
+    free((void *) m->dirty_pages);
+    free((void *) m->spare);
     free((void *) m);
 }
 
+/* dup_mem: copy of oldm; only its written pages need copying */
 mem_t *dup_mem(mem_t *oldm)
 {
     mem_t *newm = init_mem(oldm->len);
-    memcpy(newm->data, oldm->data, oldm->len);
+    long_t addr, n;
+    int i;
+
+    for (i = 0; i < oldm->n_pages; i++) {
+        addr = (long_t)oldm->pages[i] << MEM_PAGE_SHIFT;
+        n = page_bytes(oldm, oldm->pages[i]);
+        write_pages(newm, addr, n);
+        memcpy(newm->data + addr, oldm->data + addr, n);
+    }
     return newm;
 }
 
+static int cmp_page(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * diff_mem: print the 8-byte words that differ, in address order. Pages
+ *     neither memory has written are zero in both, so only the written
+ *     ones are compared.
+ */
 bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile)
 {
-    long_t pos;
+    long_t pos, end;
     int len = oldm->len;
     bool_t diff = FALSE;
+    int *pages, n = 0, i;
     
     if (newm->len < len)
 	    len = newm->len;
-    
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        long_t ov = 0;  long_t nv = 0;
-        get_long_val(oldm, pos, &ov);
-        get_long_val(newm, pos, &nv);
-        if (nv != ov) {
-            diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+
+    pages = (int *)malloc((oldm->n_pages + newm->n_pages + 1) * sizeof(int));
+    for (i = 0; i < newm->n_pages; i++)
+        pages[n++] = newm->pages[i];
+    for (i = 0; i < oldm->n_pages; i++)
+        if (oldm->pages[i] > (newm->len - 1) >> MEM_PAGE_SHIFT ||
+            !newm->touched[oldm->pages[i]])
+            pages[n++] = oldm->pages[i];
+    qsort(pages, n, sizeof(int), cmp_page);
+
+    for (i = 0; (!diff || outfile) && i < n; i++) {
+        pos = (long_t)pages[i] << MEM_PAGE_SHIFT;
+        end = pos + MEM_PAGE_SIZE < len ? pos + MEM_PAGE_SIZE : len;
+        for (; (!diff || outfile) && pos < end; pos += 8) {
+            long_t ov = 0;  long_t nv = 0;
+            get_long_val(oldm, pos, &ov);
+            get_long_val(newm, pos, &nv);
+            if (nv != ov) {
+                diff = TRUE;
+                if (outfile)
+                    fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+            }
+        }
+    }
+    free(pages);
+    return diff;
+}
+
+/*
+ * snapshot_mem: remember the current contents of m, to diff against or
+ *     go back to. Nothing is copied now: pages are saved as they are
+ *     first written afterwards, so a snapshot costs as much as the pages
+ *     dirtied since the last one.
+ */
+void snapshot_mem(mem_t *m)
+{
+    int i, page;
+
+    if (!m->saved)
+        m->saved = (byte_t **)sparse_alloc(((m->len >> MEM_PAGE_SHIFT) + 1) *
+                                           sizeof(byte_t *));
+    for (i = 0; i < m->n_dirty; i++) {
+        page = m->dirty_pages[i];
+        m->dirty[page] = 0;
+        if (m->saved[page]) {
+            add_spare(m, m->saved[page]);
+            m->saved[page] = NULL;
+        }
+    }
+    m->n_dirty = 0;
+    m->snapped = TRUE;
+    m->tlb = -1;
+}
+
+/*
+ * restore_mem: put the pages dirtied since the snapshot back as they
+ *     were then; the snapshot stays for the next run
+ */
+void restore_mem(mem_t *m)
+{
+    int i, page;
+
+    assert(m->snapped);
+    for (i = 0; i < m->n_dirty; i++) {
+        page = m->dirty_pages[i];
+        memcpy(m->data + ((long_t)page << MEM_PAGE_SHIFT), m->saved[page],
+               page_bytes(m, page));
+        m->dirty[page] = 0;
+        add_spare(m, m->saved[page]);
+        m->saved[page] = NULL;
+    }
+    m->n_dirty = 0;
+    m->tlb = -1;
+}
+
+/*
+ * diff_mem_snapshot: diff_mem() between the snapshot and the current
+ *     contents; only the dirty pages can differ
+ */
+bool_t diff_mem_snapshot(mem_t *m, FILE *outfile)
+{
+    long_t pos, end, ov, nv;
+    bool_t diff = FALSE;
+    int *pages, i;
+
+    assert(m->snapped);
+    pages = (int *)malloc((m->n_dirty + 1) * sizeof(int));
+    memcpy(pages, m->dirty_pages, m->n_dirty * sizeof(int));
+    qsort(pages, m->n_dirty, sizeof(int), cmp_page);
+
+    for (i = 0; (!diff || outfile) && i < m->n_dirty; i++) {
+        byte_t *saved = m->saved[pages[i]];
+
+        pos = (long_t)pages[i] << MEM_PAGE_SHIFT;
+        end = pos + page_bytes(m, pages[i]);
+        for (; (!diff || outfile) && pos < end; pos += 8) {
+            memcpy(&ov, saved + (pos & (MEM_PAGE_SIZE - 1)), 8);
+            memcpy(&nv, m->data + pos, 8);
+            if (nv != ov) {
+                diff = TRUE;
+                if (outfile)
+                    fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+            }
         }
     }
+    free(pages);
     return diff;
 }
 
@@ -198,20 +468,44 @@ bool_t diff_reg(mem_t *oldr, mem_t *newr, FILE *outfile)
     return diff;
 }
 
+/* Records of every page that never ran: all undecoded, never written */
+static insn_t no_insns[MEM_PAGE_SIZE];
+
 /* create an y64 image with registers and memory */
 y64sim_t *new_y64sim(int slen)
 {
     y64sim_t *sim = (y64sim_t*)malloc(sizeof(y64sim_t));
+    long_t page;
     sim->pc = 0;
     sim->r = init_reg();
     sim->m = init_mem(slen);
     sim->cc = DEFAULT_CC;
+    sim->cc_op = A_NONE;
+    sim->dec = (insn_t **)malloc(((sim->m->len >> MEM_PAGE_SHIFT) + 1) *
+                                 sizeof(insn_t *));
+    for (page = 0; page <= sim->m->len >> MEM_PAGE_SHIFT; page++)
+        sim->dec[page] = no_insns;
+    sim->code = (byte_t *)sparse_alloc(sim->m->len);
+    sim->jit = NULL;
+    sim->snap_r = NULL;
     return sim;
 }
 
+static void jit_free(y64sim_t *sim);
+
 void free_y64sim(y64sim_t *sim)
 {
+    long_t page;
+
     free_reg(sim->r);
+    if (sim->snap_r)
+        free_reg(sim->snap_r);
+    jit_free(sim);
+    for (page = 0; page <= sim->m->len >> MEM_PAGE_SHIFT; page++)
+        if (sim->dec[page] != no_insns)
+            free(sim->dec[page]);
+    free(sim->dec);
+    munmap(sim->code, sim->m->len);
     free_mem(sim->m);
     free((void *) sim);
 }
@@ -223,6 +517,8 @@ int load_binfile(mem_t *m, FILE *f)
 
     clearerr(f);
     flen = fread(m->data, sizeof(byte_t), m->len, f);
+    if (flen > 0)
+        write_pages(m, 0, flen);
     if (ferror(f)) {
         err_print("fread() failed (0x%x)", flen);
         return -1;
@@ -294,6 +590,25 @@ cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
     return PACK_CC(zero,sign,ovf);
 }
 
+/*
+ * get_cc: the current condition codes. ALU operations only record
+ *     their operands in the image; the flags are computed here, when
+ *     something looks at them.
+ * args
+ *     sim: the y64 image
+ *
+ * return
+ *     PACK_CC: the current condition codes
+ */
+cc_t get_cc(y64sim_t *sim)
+{
+    if (sim->cc_op != A_NONE) {
+        sim->cc = compute_cc(sim->cc_op, sim->cc_a, sim->cc_b, sim->cc_res);
+        sim->cc_op = A_NONE;
+    }
+    return sim->cc;
+}
+
 /*
  * cond_doit: whether do (mov or jmp) it?  
  * args
@@ -408,7 +723,7 @@ stat_t nexti(y64sim_t *sim)
     	break;
 
       case I_RRMOVQ:  /* 2:x regA:regB */
-        if (cond_doit(sim->cc, ifun))
+        if ((cond_t)ifun == C_YES || cond_doit(get_cc(sim), ifun))
             set_reg_val(sim->r, regB, get_reg_val(sim->r, regA));
         sim->pc = next_pc;
         break;
@@ -446,13 +761,21 @@ stat_t nexti(y64sim_t *sim)
         argA = get_reg_val(sim->r, regA);
         argB = get_reg_val(sim->r, regB);
         result = compute_alu(ifun, argB, argA);
-        sim->cc = compute_cc(ifun, argB, argA, result);
+        if (ifun <= A_XOR) {
+            sim->cc_op = ifun;
+            sim->cc_a = argB;
+            sim->cc_b = argA;
+            sim->cc_res = result;
+        } else {
+            sim->cc = compute_cc(ifun, argB, argA, result);
+            sim->cc_op = A_NONE;
+        }
         set_reg_val(sim->r, regB, result);
         sim->pc = next_pc;
         break;
 
       case I_JMP: /* 7:x imm */
-        if (cond_doit(sim->cc, ifun))
+        if ((cond_t)ifun == C_YES || cond_doit(get_cc(sim), ifun))
             sim->pc = immediate;
         else
             sim->pc = next_pc;
@@ -515,67 +838,1745 @@ stat_t nexti(y64sim_t *sim)
     return STAT_AOK;
 }
 
-void usage(char *pname)
+/*
+ * Pre-decoded, direct-threaded interpreter
+ *
+ * Every byte address of memory has an insn_t record in sim->dec, in
+ * blocks of one page allocated when code on the page is first decoded;
+ * until then the page shares the undecoded no_insns. The first time
+ * control reaches an address, the record is filled in from
+ * memory: the label of its handler, its registers, immediate and next
+ * PC. From then on an instruction costs one indirect jump (computed
+ * goto) to its handler, with the operands at hand. Faults found while
+ * decoding are cached as well, as handlers that report them.
+ *
+ * The registers live in a local array while running. Entry REG_NONE
+ * always reads as zero and writes to REG_NONE land in a spare entry,
+ * which is how get_reg_val/set_reg_val treat it.
+ *
+ * A store that overlaps a decoded instruction puts the records it
+ * touches back to undecoded, so self-modifying code still runs the
+ * bytes that are in memory. Results, messages and step counts are
+ * those of calling nexti() in a loop.
+ */
+
+#define INSN_MAX_LEN 10
+#define REG_SINK (REG_NONE + 1)
+
+/* The record at pc, or NULL if its page never ran */
+static inline insn_t *find_insn(y64sim_t *sim, long_t pc)
 {
-    printf("Usage: %s file.bin [max_steps]\n", pname);
-    exit(0);
+    insn_t *page = sim->dec[pc >> MEM_PAGE_SHIFT];
+    return page != no_insns ? page + (pc & (MEM_PAGE_SIZE - 1)) : NULL;
 }
 
-int main(int argc, char *argv[])
+/* The record at pc, allocating the records of its page if need be */
+static inline insn_t *get_insn(y64sim_t *sim, long_t pc)
 {
-    FILE *binfile;
-    int max_steps = MAX_STEP;
-    y64sim_t *sim;
-    mem_t *saver, *savem;
-    int step = 0;
+    insn_t **page = sim->dec + (pc >> MEM_PAGE_SHIFT);
+
+    if (*page == no_insns)
+        *page = (insn_t *)page_alloc(sizeof(insn_t));
+    return *page + (pc & (MEM_PAGE_SIZE - 1));
+}
+
+static inline bool_t load_long(mem_t *m, long_t addr, long_t *dest)
+{
+    if (!mem_read(m, addr, 8))
+        return FALSE;
+    memcpy(dest, m->data + addr, 8);
+    return TRUE;
+}
+
+/*
+ * store_long: set_long_val() that keeps the decoded records coherent
+ */
+static void jit_invalidate(y64sim_t *sim, long_t lo, long_t hi);
+
+/*
+ * invalidate_code: forget what was decoded or compiled from the 8 bytes
+ *     at addr; instructions starting in [addr - 9, addr + 7] may overlap
+ *     them
+ */
+static void invalidate_code(y64sim_t *sim, long_t addr)
+{
+    long_t lo, hi;
+    insn_t *ip;
+
+    lo = addr - (INSN_MAX_LEN - 1) > 0 ? addr - (INSN_MAX_LEN - 1) : 0;
+    hi = addr + 7;
+    if (sim->jit)
+        jit_invalidate(sim, addr, hi);
+    for (; lo <= hi; lo++)
+        if ((ip = find_insn(sim, lo)))
+            ip->handler = NULL;
+}
+
+/*
+ * store_long: set_long_val() that keeps the decoded records coherent.
+ *     sim->code flags every byte an instruction was decoded from; the
+ *     flags are never cleared, which at worst costs a needless
+ *     invalidation, so data next to code stays cheap to write.
+ */
+static inline bool_t store_long(y64sim_t *sim, long_t addr, long_t val)
+{
+    uint64_t flags;
+
+    if (addr < 0 || addr > sim->m->len - 8)
+        return FALSE;
+    mem_write(sim->m, addr, 8);
+    memcpy(sim->m->data + addr, &val, 8);
+    memcpy(&flags, sim->code + addr, 8);
+    if (flags)
+        invalidate_code(sim, addr);
+    return TRUE;
+}
+
+/*
+ * snapshot_y64sim: checkpoint the image. Registers, PC and CC are
+ *     copied; memory is copied on write, see snapshot_mem().
+ */
+void snapshot_y64sim(y64sim_t *sim)
+{
+    if (sim->snap_r)
+        free_reg(sim->snap_r);
+    sim->snap_r = dup_reg(sim->r);
+    sim->snap_pc = sim->pc;
+    sim->snap_cc = get_cc(sim);
+    snapshot_mem(sim->m);
+}
+
+/*
+ * restore_y64sim: go back to the checkpoint, for another run from the
+ *     same loaded image. Code restored under decoded or compiled
+ *     instructions is dropped from them.
+ */
+void restore_y64sim(y64sim_t *sim)
+{
+    mem_t *m = sim->m;
+    long_t addr, end;
+    uint64_t flags;
+    int i;
+
+    for (i = 0; i < m->n_dirty; i++) {
+        addr = (long_t)m->dirty_pages[i] << MEM_PAGE_SHIFT;
+        end = addr + page_bytes(m, m->dirty_pages[i]);
+        for (; addr < end; addr += 8) {
+            memcpy(&flags, sim->code + addr, 8);
+            if (flags && memcmp(m->data + addr,
+                                m->saved[m->dirty_pages[i]] +
+                                (addr & (MEM_PAGE_SIZE - 1)), 8))
+                invalidate_code(sim, addr);
+        }
+    }
+    restore_mem(m);
+    for (i = 0; i < REG_NONE; i++)
+        set_reg_val(sim->r, i, get_reg_val(sim->snap_r, i));
+    sim->pc = sim->snap_pc;
+    sim->cc = sim->snap_cc;
+    sim->cc_op = A_NONE;
+}
+
+/*
+ * run_y64sim: execute up to max_steps instructions
+ * args
+ *     sim: the y64 image with PC, register and memory
+ *     max_steps: step limit
+ *     steps: set to the number of steps taken, counting the one that
+ *         halted or faulted
+ *
+ * return
+ *     status of the last step, as nexti() would have returned it
+ */
+stat_t run_y64sim(y64sim_t *sim, int max_steps, int *steps)
+{
+    static void *const alu_labels[] = { &&L_ADD, &&L_SUB, &&L_AND, &&L_XOR };
+    long_t R[REG_SINK + 1];
+    long_t pc = sim->pc, len = sim->m->len;
+    long_t argA, argB, result;
+    cc_t cc = sim->cc;
+    alu_t cc_op = sim->cc_op;
+    long_t cc_a = sim->cc_a, cc_b = sim->cc_b, cc_res = sim->cc_res;
+    long_t page = -1;               /* whole page of pc, records at recs */
+    insn_t *ip, *recs = NULL;
+    byte_t b;
+    int i, n = 0;
     stat_t e = STAT_AOK;
 
-    if (argc < 2 || argc > 3)
-        usage(argv[0]);
+    for (i = 0; i < REG_NONE; i++)
+        R[i] = get_reg_val(sim->r, i);
+    R[REG_NONE] = 0;
+
+dispatch:
+    if (n >= max_steps)
+        goto out;
+    n++;
+    /* On the page of the last instruction, pc is known to be in range;
+       the page is kept only if whole, like the TLB of mem_read() */
+    if (__builtin_expect((long_t)((uint64_t)pc >> MEM_PAGE_SHIFT) != page, 0)) {
+        if (pc < 0 || pc >= len) {
+            err_print("PC = 0x%lx, Invalid instruction address", pc);
+            e = STAT_ADR;
+            goto out;
+        }
+        page = pc >> MEM_PAGE_SHIFT;
+        recs = sim->dec[page];
+        if (page_bytes(sim->m, page) != MEM_PAGE_SIZE)
+            page = -1;
+    }
+    ip = recs + (pc & (MEM_PAGE_SIZE - 1));
+    if (!ip->handler)
+        goto decode;
+    goto *ip->handler;
+
+decode:
+    ip = get_insn(sim, pc);
+    recs = sim->dec[pc >> MEM_PAGE_SHIFT];
+    /* Same fetch order and checks as nexti() */
+    ip->codefun = b = sim->m->data[pc];
+    ip->fun = GET_FUN(b);
+    ip->next_pc = pc + 1;
+    ip->rA = ip->rB = REG_NONE;
+    ip->wA = ip->wB = REG_SINK;
+    switch (GET_ICODE(b)) {
+    case I_RRMOVQ: case I_IRMOVQ: case I_RMMOVQ: case I_MRMOVQ:
+    case I_ALU: case I_PUSHQ: case I_POPQ:
+        if (ip->next_pc >= len) {
+            ip->handler = &&L_BADPC;
+            goto decoded;
+        }
+        b = sim->m->data[ip->next_pc++];
+        ip->rA = GET_REGA(b);
+        ip->rB = GET_REGB(b);
+        ip->wA = NONE_REG(ip->rA) ? REG_SINK : ip->rA;
+        ip->wB = NONE_REG(ip->rB) ? REG_SINK : ip->rB;
+        break;
+    default:
+        break;
+    }
+    switch (GET_ICODE(ip->codefun)) {
+    case I_IRMOVQ: case I_RMMOVQ: case I_MRMOVQ: case I_JMP: case I_CALL:
+        if (!load_long(sim->m, ip->next_pc, &ip->imm)) {
+            ip->handler = &&L_BADPC;
+            goto decoded;
+        }
+        ip->next_pc += 8;
+        break;
+    default:
+        break;
+    }
+    switch (GET_ICODE(ip->codefun)) {
+    case I_HALT:   ip->handler = &&L_HALT; break;
+    case I_NOP:    ip->handler = &&L_NOP; break;
+    case I_RRMOVQ: ip->handler = ip->fun == C_YES ? &&L_RRMOVQ : &&L_CMOVXX; break;
+    case I_IRMOVQ: ip->handler = &&L_IRMOVQ; break;
+    case I_RMMOVQ: ip->handler = &&L_RMMOVQ; break;
+    case I_MRMOVQ: ip->handler = &&L_MRMOVQ; break;
+    case I_ALU:    ip->handler = ip->fun <= A_XOR ? alu_labels[ip->fun] : &&L_ALUXX; break;
+    case I_JMP:    ip->handler = ip->fun == C_YES ? &&L_JMP : &&L_JXX; break;
+    case I_CALL:   ip->handler = &&L_CALL; break;
+    case I_RET:    ip->handler = &&L_RET; break;
+    case I_PUSHQ:  ip->handler = &&L_PUSHQ; break;
+    case I_POPQ:   ip->handler = &&L_POPQ; break;
+    default:       ip->handler = &&L_BADINS; break;
+    }
+decoded:
+    memset(sim->code + pc, 1, (ip->next_pc < len ? ip->next_pc : len) - pc);
+    goto *ip->handler;
+
+L_HALT:
+    e = STAT_HLT;
+    goto out;
+
+L_NOP:
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_RRMOVQ:
+    R[ip->wB] = R[ip->rA];
+    pc = ip->next_pc;
+    goto dispatch;
+
+#define SYNC_CC()                                       \
+    if (cc_op != A_NONE) {                              \
+        cc = compute_cc(cc_op, cc_a, cc_b, cc_res);     \
+        cc_op = A_NONE;                                 \
+    }
 
-    /* set max steps */
-    if (argc > 2)
-        max_steps = atoi(argv[2]);
+L_CMOVXX:
+    SYNC_CC();
+    if (cond_doit(cc, ip->fun))
+        R[ip->wB] = R[ip->rA];
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_IRMOVQ:
+    R[ip->wB] = ip->imm;
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_RMMOVQ:
+    result = ip->imm + R[ip->rB];
+    if (!store_long(sim, result, R[ip->rA])) {
+        err_print("PC = 0x%lx, Invalid data address 0x%lx", pc, result);
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_MRMOVQ:
+    result = ip->imm + R[ip->rB];
+    if (!load_long(sim->m, result, &argA)) {
+        err_print("PC = 0x%lx, Invalid data address 0x%lx", pc, result);
+        e = STAT_ADR;
+        goto out;
+    }
+    R[ip->wA] = argA;
+    pc = ip->next_pc;
+    goto dispatch;
+
+#define ALU_CASE(label, op, expr)                       \
+label:                                                  \
+    argA = R[ip->rA];                                   \
+    argB = R[ip->rB];                                   \
+    result = (expr);                                    \
+    cc_op = (op);                                       \
+    cc_a = argB;                                        \
+    cc_b = argA;                                        \
+    cc_res = result;                                    \
+    R[ip->wB] = result;                                 \
+    pc = ip->next_pc;                                   \
+    goto dispatch;
+
+    ALU_CASE(L_ADD, A_ADD, (long_t)((uint64_t)argB + (uint64_t)argA))
+    ALU_CASE(L_SUB, A_SUB, (long_t)((uint64_t)argB - (uint64_t)argA))
+    ALU_CASE(L_AND, A_AND, argB & argA)
+    ALU_CASE(L_XOR, A_XOR, argB ^ argA)
+
+L_ALUXX:
+    argA = R[ip->rA];
+    argB = R[ip->rB];
+    result = compute_alu(ip->fun, argB, argA);
+    cc = compute_cc(ip->fun, argB, argA, result);
+    cc_op = A_NONE;
+    R[ip->wB] = result;
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_JMP:
+    pc = ip->imm;
+    goto dispatch;
+
+L_JXX:
+    SYNC_CC();
+    pc = cond_doit(cc, ip->fun) ? ip->imm : ip->next_pc;
+    goto dispatch;
+
+L_CALL:
+    result = R[REG_RSP] - 8;
+    R[REG_RSP] = result;
+    if (!store_long(sim, result, ip->next_pc)) {
+        err_print("PC = 0x%lx, Invalid stack address 0x%lx", pc, result);
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = ip->imm;
+    goto dispatch;
+
+L_RET:
+    argA = R[REG_RSP];
+    if (!load_long(sim->m, argA, &argB)) {
+        err_print("PC = 0x%lx, Invalid stack address 0x%lx", pc, argA);
+        e = STAT_ADR;
+        goto out;
+    }
+    R[REG_RSP] = argA + 8;
+    pc = argB;
+    goto dispatch;
+
+L_PUSHQ:
+    argA = R[ip->rA];
+    result = R[REG_RSP] - 8;
+    R[REG_RSP] = result;
+    if (!store_long(sim, result, argA)) {
+        err_print("PC = 0x%lx, Invalid stack address 0x%lx", pc, result);
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_POPQ:
+    argA = R[REG_RSP];
+    R[REG_RSP] = argA + 8;
+    if (!load_long(sim->m, argA, &argB)) {
+        err_print("PC = 0x%lx, Invalid stack address 0x%lx", pc, argA);
+        e = STAT_ADR;
+        goto out;
+    }
+    R[ip->wA] = argB;
+    pc = ip->next_pc;
+    goto dispatch;
+
+L_BADPC:
+    err_print("PC = 0x%lx, Invalid instruction address", pc);
+    e = STAT_ADR;
+    goto out;
+
+L_BADINS:
+    err_print("PC = 0x%lx, Invalid instruction %.2x", pc, ip->codefun);
+    e = STAT_INS;
+    goto out;
+
+out:
+    for (i = 0; i < REG_NONE; i++)
+        set_reg_val(sim->r, i, R[i]);
+    sim->pc = pc;
+    sim->cc = cc;
+    sim->cc_op = cc_op;
+    sim->cc_a = cc_a;
+    sim->cc_b = cc_b;
+    sim->cc_res = cc_res;
+    *steps = n;
+    return e;
+}
 
-    /* load binary file to memory */
-    if (strcmp(argv[1]+(strlen(argv[1])-4), ".bin"))
-        usage(argv[0]); /* only support *.bin file */
-    
-    binfile = fopen(argv[1], "rb");
-    if (!binfile) {
-        err_print("Can't open binary file '%s'", argv[1]);
+/*
+ * Basic-block JIT (-j)
+ *
+ * Control transfers land on block starts. Once a block start has been
+ * reached JIT_HOT times, the decoded records from there up to and
+ * including the next jXX, call or ret are translated into x86-64 in an
+ * executable buffer. Native code works on the register file in sim->r
+ * directly (rbx), with memory in r12 and the jit_state_t in r13:
+ *
+ *     long_t block(long_t *regs, byte_t *mem, jit_state_t *st)
+ *
+ * returns the next PC and adds the number of Y64 instructions it
+ * completed to st->executed.
+ *
+ * Blocks are chained: an exit to a known PC jumps straight into the
+ * block compiled there, or is patched to once that block is compiled,
+ * and ret looks its target up in the table of blocks, which has a page
+ * of entries for each page that has run. Every block first checks that
+ * it fits into st->limit, so chains stop exactly at max_steps.
+ *
+ * Condition codes are lazy: an ALU operation only leaves its operation,
+ * operands and result in the state, and only if something may look at
+ * them before the next ALU operation overwrites them. compute_cc() runs
+ * when a jXX or cmovXX needs the flags; a pending operation is passed
+ * to and from the simulator's own lazy condition codes as it is.
+ *
+ * Anything out of the ordinary leaves native code: an access outside
+ * memory exits just before the faulting instruction, and the
+ * interpreter then executes that one, so statuses, messages and partial
+ * updates are its own. halt, invalid instructions and undecoded bytes
+ * end a block the same way. A store that overlaps decoded code exits
+ * right after the store, and all compiled code is dropped, which also
+ * undoes the chaining. A store to a page that is not dirty yet leaves
+ * just before it, so that the interpreter saves and flags the page.
+ */
+
+#define JIT_HOT 16                  /* visits before a block is compiled */
+#define JIT_MAX_INSNS 64            /* longest block */
+#define JIT_BUF_SIZE (4 << 20)      /* executable buffer; flushed when full */
+#define JIT_INSN_ROOM 256           /* enough bytes for any one instruction */
+
+typedef struct jit_state {
+    long_t cc_op;                   /* last ALU op, A_NONE if cc is current */
+    long_t cc_a, cc_b, cc_res;      /* its compute_cc() arguments */
+    long_t executed;
+    long_t limit;                   /* most instructions to execute */
+    long_t smc_addr;                /* store into code, -1 if none */
+    byte_t *code;                   /* sim->code */
+    byte_t *dirty;                  /* sim->m->dirty */
+    struct jit_block ***map;        /* jit->map */
+    cc_t cc;
+} jit_state_t;
+
+typedef long_t (*jit_code_t)(long_t *regs, byte_t *mem, jit_state_t *st);
+
+typedef struct jit_block {
+    long_t start, end;              /* Y64 bytes [start, end) */
+    int count;                      /* visits while not compiled */
+    int len;                        /* instructions */
+    jit_code_t code;                /* NULL if not compiled */
+    byte_t *body;                   /* chained blocks jump here */
+    struct jit_block *next;         /* list of compiled blocks */
+    struct jit_block *link;         /* list of all blocks */
+} jit_block_t;
+
+/* An exit waiting for the block at pc to be compiled */
+typedef struct jit_patch {
+    byte_t *rel;                    /* rel32 of its jmp */
+    long_t pc;
+} jit_patch_t;
+
+typedef struct jit {
+    byte_t *buf;
+    size_t used;
+    jit_block_t ***map;             /* per page, the block starting at
+                                       each address; NULL until it runs */
+    jit_block_t *compiled;
+    jit_block_t *blocks;
+    jit_patch_t *patches;
+    int n_patches, max_patches;
+    jit_state_t st;
+} jit_t;
+
+#define ST(field) ((byte_t)offsetof(jit_state_t, field))
+#define BLK(field) ((byte_t)offsetof(jit_block_t, field))
+#define REG(id) ((byte_t)((id) * 8))
+
+/* Registers in ModRM encodings */
+#define X_RAX 0
+#define X_RCX 1
+#define X_RDX 2
+
+static void jit_init(y64sim_t *sim)
+{
+    jit_t *jit = (jit_t *)calloc(1, sizeof(jit_t));
+
+    jit->buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buf == MAP_FAILED) {
+        err_print("mmap() of the JIT buffer failed (0x%x)", JIT_BUF_SIZE);
         exit(1);
     }
+    jit->map = (jit_block_t ***)calloc((sim->m->len >> MEM_PAGE_SHIFT) + 1,
+                                       sizeof(jit_block_t **));
+    /* Native code writes registers behind set_reg_val()'s back */
+    write_pages(sim->r, 0, sim->r->len);
+    sim->jit = jit;
+}
+
+static void jit_free(y64sim_t *sim)
+{
+    jit_t *jit = sim->jit;
+    jit_block_t *blk;
+    long_t page;
+
+    if (!jit)
+        return;
+    while ((blk = jit->blocks)) {
+        jit->blocks = blk->link;
+        free(blk);
+    }
+    for (page = 0; page <= sim->m->len >> MEM_PAGE_SHIFT; page++)
+        free(jit->map[page]);
+    free(jit->map);
+    free(jit->patches);
+    munmap(jit->buf, JIT_BUF_SIZE);
+    free(jit);
+    sim->jit = NULL;
+}
+
+/*
+ * jit_flush: drop all compiled code and start over with an empty buffer
+ */
+static void jit_flush(jit_t *jit)
+{
+    jit_block_t *blk;
+
+    for (blk = jit->compiled; blk; blk = blk->next) {
+        blk->code = NULL;
+        blk->body = NULL;
+        blk->count = 0;
+    }
+    jit->compiled = NULL;
+    jit->n_patches = 0;
+    jit->used = 0;
+}
+
+/* The block starting at pc, or NULL if there is none */
+static inline jit_block_t *jit_find(jit_t *jit, long_t pc)
+{
+    jit_block_t **page = jit->map[pc >> MEM_PAGE_SHIFT];
+    return page ? page[pc & (MEM_PAGE_SIZE - 1)] : NULL;
+}
+
+/* Where the block starting at pc goes, allocating the page's entries */
+static inline jit_block_t **jit_slot(jit_t *jit, long_t pc)
+{
+    jit_block_t ***page = jit->map + (pc >> MEM_PAGE_SHIFT);
+
+    if (!*page)
+        *page = (jit_block_t **)page_alloc(sizeof(jit_block_t *));
+    return *page + (pc & (MEM_PAGE_SIZE - 1));
+}
+
+/*
+ * jit_invalidate: drop compiled code if any block overlaps [lo, hi].
+ *     Other blocks may be chained to the ones overlapping, so it all goes.
+ */
+static void jit_invalidate(y64sim_t *sim, long_t lo, long_t hi)
+{
+    jit_block_t *blk;
+
+    for (blk = sim->jit->compiled; blk; blk = blk->next) {
+        if (blk->start <= hi && blk->end > lo) {
+            jit_flush(sim->jit);
+            return;
+        }
+    }
+}
+
+/*
+ * jit_cond: cond_doit() on the lazy condition codes, called from
+ *     native code
+ */
+static long jit_cond(jit_state_t *st, long cond)
+{
+    if (st->cc_op != A_NONE) {
+        st->cc = compute_cc(st->cc_op, st->cc_a, st->cc_b, st->cc_res);
+        st->cc_op = A_NONE;
+    }
+    return cond_doit(st->cc, cond);
+}
+
+static inline byte_t *emit1(byte_t *p, int b)
+{
+    *p++ = (byte_t)b;
+    return p;
+}
+
+static inline byte_t *emit4(byte_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static inline byte_t *emit8(byte_t *p, uint64_t v)
+{
+    memcpy(p, &v, 8);
+    return p + 8;
+}
+
+/* mov x, [rbx + 8*id] */
+static byte_t *emit_get(byte_t *p, int x, int id)
+{
+    p = emit1(emit1(emit1(p, 0x48), 0x8B), 0x43 | x << 3);
+    return emit1(p, REG(id));
+}
+
+/* mov [rbx + 8*id], x */
+static byte_t *emit_put(byte_t *p, int x, int id)
+{
+    p = emit1(emit1(emit1(p, 0x48), 0x89), 0x43 | x << 3);
+    return emit1(p, REG(id));
+}
+
+/* mov [r13 + off], x */
+static byte_t *emit_st(byte_t *p, int x, byte_t off)
+{
+    p = emit1(emit1(emit1(p, 0x49), 0x89), 0x45 | x << 3);
+    return emit1(p, off);
+}
+
+/* mov x, imm64 */
+static byte_t *emit_imm(byte_t *p, int x, long_t imm)
+{
+    return emit8(emit1(emit1(p, 0x48), 0xB8 | x), imm);
+}
+
+/*
+ * emit_exit: count n instructions done and go to pc, by returning it
+ *     through the epilogue in front of the block or by jumping to the
+ *     body of the block there. 23 bytes.
+ */
+static byte_t *emit_exit(byte_t *p, byte_t *epilogue, long_t pc, int n)
+{
+    p = emit1(emit1(emit1(emit1(p, 0x49), 0x81), 0x45), ST(executed));
+    p = emit4(p, n);
+    p = emit_imm(p, X_RAX, pc);
+    p = emit1(p, 0xE9);
+    return emit4(p, (uint32_t)(epilogue - (p + 4)));
+}
+
+/*
+ * emit_chain: emit_exit() to the compiled block at pc, or to the
+ *     epilogue until that block is compiled
+ */
+static byte_t *emit_chain(jit_t *jit, long_t len, byte_t *p, byte_t *epilogue,
+                          long_t pc, int n)
+{
+    jit_patch_t *patch;
+    jit_block_t *blk;
+
+    if (pc >= 0 && pc < len && (blk = jit_find(jit, pc)) && blk->body)
+        return emit_exit(p, blk->body, pc, n);
+    p = emit_exit(p, epilogue, pc, n);
+    if (pc >= 0 && pc < len) {
+        if (jit->n_patches == jit->max_patches) {
+            jit->max_patches = jit->max_patches ? 2 * jit->max_patches : 64;
+            jit->patches = (jit_patch_t *)realloc(jit->patches,
+                               jit->max_patches * sizeof(jit_patch_t));
+        }
+        patch = jit->patches + jit->n_patches++;
+        patch->rel = p - 4;
+        patch->pc = pc;
+    }
+    return p;
+}
+
+/*
+ * emit_addr: rdx = imm + R[id], and leave the block before instruction
+ *     n at pc unless 8 bytes at rdx are inside memory
+ */
+static byte_t *emit_addr(byte_t *p, byte_t *epilogue, long_t len,
+                         long_t imm, int id, long_t pc, int n)
+{
+    p = emit_imm(p, X_RDX, imm);
+    if (!NONE_REG(id))
+        p = emit1(emit1(emit1(emit1(p, 0x48), 0x03), 0x53), REG(id));
+    /* cmp rdx, len - 8; jbe ok */
+    p = emit4(emit1(emit1(emit1(p, 0x48), 0x81), 0xFA), (uint32_t)(len - 8));
+    p = emit1(emit1(p, 0x76), 23);
+    return emit_exit(p, epilogue, pc, n);
+}
+
+/*
+ * emit_dirty: before a store of 8 bytes at rdx, leave the block before
+ *     instruction n at pc unless their pages are dirty already, so the
+ *     interpreter does the store that saves or flags a page
+ */
+static byte_t *emit_dirty(byte_t *p, byte_t *epilogue, long_t pc, int n)
+{
+    byte_t *to_exit[2];
+    int i;
+
+    /* mov rax, [r13 + dirty], then for rdx and rdx + 7:
+       lea rcx, [rdx + i]; shr rcx, 12; cmp byte [rax + rcx], 0; je exit */
+    p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x45), ST(dirty));
+    for (i = 0; i < 2; i++) {
+        p = emit1(emit1(emit1(emit1(p, 0x48), 0x8D), 0x4A), i ? 7 : 0);
+        p = emit1(emit1(emit1(emit1(p, 0x48), 0xC1), 0xE9), MEM_PAGE_SHIFT);
+        p = emit1(emit1(emit1(emit1(p, 0x80), 0x3C), 0x08), 0x00);
+        p = emit1(emit1(p, 0x74), 0);
+        to_exit[i] = p;
+    }
+    p = emit1(emit1(p, 0xEB), 23);                          /* jmp skip */
+    for (i = 0; i < 2; i++)
+        to_exit[i][-1] = (byte_t)(p - to_exit[i]);
+    return emit_exit(p, epilogue, pc, n);
+}
+
+/*
+ * emit_smc: after a store of 8 bytes at rdx, leave the block at next_pc
+ *     with n instructions done if any of them is flagged as code
+ */
+static byte_t *emit_smc(byte_t *p, byte_t *epilogue, long_t next_pc, int n)
+{
+    /* mov rax, [r13 + code]; mov rax, [rax + rdx]; test rax, rax; jz skip */
+    p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x45), ST(code));
+    p = emit1(emit1(emit1(emit1(p, 0x48), 0x8B), 0x04), 0x10);
+    p = emit1(emit1(emit1(p, 0x48), 0x85), 0xC0);
+    p = emit1(emit1(p, 0x74), 4 + 23);
+    p = emit_st(p, X_RDX, ST(smc_addr));
+    return emit_exit(p, epilogue, next_pc, n);
+}
+
+/* test rcx, rcx; jz epilogue */
+static byte_t *emit_null_exit(byte_t *p, byte_t *epilogue)
+{
+    p = emit1(emit1(emit1(p, 0x48), 0x85), 0xC9);
+    p = emit1(emit1(p, 0x0F), 0x84);
+    return emit4(p, (uint32_t)(epilogue - (p + 4)));
+}
+
+/* rax = jit_cond(st, cond) */
+static byte_t *emit_cond(byte_t *p, int cond)
+{
+    p = emit1(emit1(emit1(p, 0x4C), 0x89), 0xEF);         /* mov rdi, r13 */
+    p = emit4(emit1(p, 0xBE), cond);                        /* mov esi, cond */
+    p = emit_imm(p, X_RAX, (long_t)jit_cond);
+    p = emit1(emit1(p, 0xFF), 0xD0);                        /* call rax */
+    return emit1(emit1(p, 0x85), 0xC0);                     /* test eax, eax */
+}
+
+/*
+ * jit_compile: translate the block at blk->start, if there is anything
+ *     to translate
+ */
+static void jit_compile(y64sim_t *sim, jit_block_t *blk)
+{
+    static const byte_t alu_ops[] = { 0x01, 0x29, 0x21, 0x31 };
+    jit_t *jit = sim->jit;
+    long_t len = sim->m->len, pc = blk->start;
+    insn_t *ip, *rec[JIT_MAX_INSNS];
+    byte_t *p, *epilogue, *entry, *body;
+    int n, k, j, icode, ends = 0, keep_cc;
+
+    /* Collect the instructions; cut before anything not translated */
+    for (n = 0; n < JIT_MAX_INSNS && !ends && pc >= 0 && pc < len; n++) {
+        ip = find_insn(sim, pc);
+        if (!ip || !ip->handler)
+            break;
+        icode = GET_ICODE(ip->codefun);
+        if (icode == I_HALT || icode > I_POPQ || ip->next_pc > len ||
+            (icode == I_ALU && ip->fun > A_XOR))
+            break;
+        /* Records of instructions cut off by the end of memory hold junk */
+        if (ip->next_pc - pc != (icode == I_NOP || icode == I_RET ? 1 :
+                                 icode == I_JMP || icode == I_CALL ? 9 :
+                                 icode >= I_IRMOVQ && icode <= I_MRMOVQ ? 10 : 2))
+            break;
+        ends = icode == I_JMP || icode == I_CALL || icode == I_RET;
+        rec[n] = ip;
+        pc = ip->next_pc;
+    }
+    if (n == 0) {
+        blk->count = -1;            /* never worth another look */
+        return;
+    }
+
+    if (jit->used + 128 + (size_t)n * JIT_INSN_ROOM > JIT_BUF_SIZE)
+        jit_flush(jit);
+    p = jit->buf + jit->used;
+
+    /* pop r13; pop r12; pop rbx; ret */
+    epilogue = p;
+    p = emit1(emit1(p, 0x41), 0x5D);
+    p = emit1(emit1(p, 0x41), 0x5C);
+    p = emit1(emit1(p, 0x5B), 0xC3);
+    /* push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi; mov r13, rdx */
+    entry = p;
+    p = emit1(p, 0x53);
+    p = emit1(emit1(p, 0x41), 0x54);
+    p = emit1(emit1(p, 0x41), 0x55);
+    p = emit1(emit1(emit1(p, 0x48), 0x89), 0xFB);
+    p = emit1(emit1(emit1(p, 0x49), 0x89), 0xF4);
+    p = emit1(emit1(emit1(p, 0x49), 0x89), 0xD5);
+
+    /* Leave unless executed + n <= limit */
+    body = p;
+    blk->body = body;
+    p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x45), ST(executed));
+    p = emit4(emit1(emit1(p, 0x48), 0x05), n);                 /* add rax, n */
+    p = emit1(emit1(emit1(emit1(p, 0x49), 0x3B), 0x45), ST(limit));
+    p = emit1(emit1(p, 0x7E), 23);                              /* jle */
+    p = emit_exit(p, epilogue, blk->start, 0);
+
+    for (k = 0, pc = blk->start; k < n; pc = rec[k]->next_pc, k++) {
+        byte_t *skip;
+        ip = rec[k];
+        icode = GET_ICODE(ip->codefun);
+
+        switch (icode) {
+        case I_NOP:
+            break;
+
+        case I_RRMOVQ:
+            skip = NULL;
+            if (ip->fun != C_YES) {
+                p = emit_cond(p, ip->fun);
+                p = emit1(emit1(p, 0x74), 0);               /* jz skip */
+                skip = p;
+            }
+            if (!NONE_REG(ip->rB)) {
+                p = emit_get(p, X_RAX, ip->rA);
+                p = emit_put(p, X_RAX, ip->rB);
+            }
+            if (skip)
+                skip[-1] = (byte_t)(p - skip);
+            break;
+
+        case I_IRMOVQ:
+            if (!NONE_REG(ip->rB)) {
+                p = emit_imm(p, X_RAX, ip->imm);
+                p = emit_put(p, X_RAX, ip->rB);
+            }
+            break;
+
+        case I_RMMOVQ:
+            p = emit_addr(p, epilogue, len, ip->imm, ip->rB, pc, k);
+            p = emit_dirty(p, epilogue, pc, k);
+            p = emit_get(p, X_RCX, ip->rA);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x89), 0x0C), 0x14);  /* mov [r12+rdx], rcx */
+            p = emit_smc(p, epilogue, ip->next_pc, k + 1);
+            break;
+
+        case I_MRMOVQ:
+            p = emit_addr(p, epilogue, len, ip->imm, ip->rB, pc, k);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x04), 0x14);  /* mov rax, [r12+rdx] */
+            if (!NONE_REG(ip->rA))
+                p = emit_put(p, X_RAX, ip->rA);
+            break;
+
+        case I_ALU:
+            /* The flags matter if a later cmov, jXX, side exit or the end
+               of the block comes before the next ALU operation */
+            keep_cc = 1;
+            for (j = k + 1; j < n; j++) {
+                int c = GET_ICODE(rec[j]->codefun);
+                if ((c == I_RRMOVQ && rec[j]->fun != C_YES) || c == I_JMP ||
+                    c == I_RMMOVQ || c == I_MRMOVQ || c == I_CALL ||
+                    c == I_RET || c == I_PUSHQ || c == I_POPQ)
+                    break;
+                if (c == I_ALU) {
+                    keep_cc = 0;
+                    break;
+                }
+            }
+            p = emit_get(p, X_RAX, ip->rB);
+            p = emit_get(p, X_RCX, ip->rA);
+            if (keep_cc)
+                p = emit1(emit1(emit1(p, 0x48), 0x89), 0xC2);   /* mov rdx, rax */
+            p = emit1(emit1(emit1(p, 0x48), alu_ops[ip->fun]), 0xC8);  /* op rax, rcx */
+            if (keep_cc) {
+                p = emit_st(p, X_RDX, ST(cc_a));
+                p = emit_st(p, X_RCX, ST(cc_b));
+                p = emit_st(p, X_RAX, ST(cc_res));
+                p = emit1(emit1(emit1(emit1(p, 0x49), 0xC7), 0x45), ST(cc_op));
+                p = emit4(p, ip->fun);
+            }
+            if (!NONE_REG(ip->rB))
+                p = emit_put(p, X_RAX, ip->rB);
+            break;
+
+        case I_JMP:
+            if (ip->fun != C_YES) {
+                p = emit_cond(p, ip->fun);
+                p = emit1(emit1(p, 0x74), 23);              /* jz not taken */
+                p = emit_chain(jit, len, p, epilogue, ip->imm, k + 1);
+                p = emit_chain(jit, len, p, epilogue, ip->next_pc, k + 1);
+            } else {
+                p = emit_chain(jit, len, p, epilogue, ip->imm, k + 1);
+            }
+            break;
+
+        case I_CALL:
+            p = emit_get(p, X_RDX, REG_RSP);
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x83), 0xEA), 8);    /* sub rdx, 8 */
+            p = emit4(emit1(emit1(emit1(p, 0x48), 0x81), 0xFA), (uint32_t)(len - 8));
+            p = emit1(emit1(p, 0x76), 23);
+            p = emit_exit(p, epilogue, pc, k);
+            p = emit_dirty(p, epilogue, pc, k);
+            p = emit_imm(p, X_RCX, ip->next_pc);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x89), 0x0C), 0x14);  /* mov [r12+rdx], rcx */
+            p = emit_put(p, X_RDX, REG_RSP);
+            p = emit_smc(p, epilogue, ip->imm, k + 1);
+            p = emit_chain(jit, len, p, epilogue, ip->imm, k + 1);
+            break;
+
+        case I_RET:
+            p = emit_get(p, X_RDX, REG_RSP);
+            p = emit4(emit1(emit1(emit1(p, 0x48), 0x81), 0xFA), (uint32_t)(len - 8));
+            p = emit1(emit1(p, 0x76), 23);
+            p = emit_exit(p, epilogue, pc, k);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x04), 0x14);  /* mov rax, [r12+rdx] */
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x8D), 0x4A), 8);    /* lea rcx, [rdx+8] */
+            p = emit_put(p, X_RCX, REG_RSP);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x81), 0x45), ST(executed));
+            p = emit4(p, k + 1);
+            /* Go on in the block compiled at rax, if there is one: find
+               the page's entries, the block, then its body */
+            p = emit4(emit1(emit1(p, 0x48), 0x3D), (uint32_t)len);  /* cmp rax, len */
+            p = emit1(emit1(p, 0x0F), 0x83);                        /* jae epilogue */
+            p = emit4(p, (uint32_t)(epilogue - (p + 4)));
+            p = emit1(emit1(emit1(p, 0x48), 0x89), 0xC1);           /* mov rcx, rax */
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0xC1), 0xE9), MEM_PAGE_SHIFT);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x55), ST(map));
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x8B), 0x0C), 0xCA); /* mov rcx, [rdx+8*rcx] */
+            p = emit_null_exit(p, epilogue);
+            p = emit1(emit1(p, 0x89), 0xC2);                        /* mov edx, eax */
+            p = emit4(emit1(emit1(p, 0x81), 0xE2), MEM_PAGE_SIZE - 1);  /* and edx, mask */
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x8B), 0x0C), 0xD1); /* mov rcx, [rcx+8*rdx] */
+            p = emit_null_exit(p, epilogue);
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x8B), 0x49), BLK(body));
+            p = emit_null_exit(p, epilogue);
+            p = emit1(emit1(p, 0xFF), 0xE1);                        /* jmp rcx */
+            break;
+
+        case I_PUSHQ:
+            p = emit_get(p, X_RDX, REG_RSP);
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x83), 0xEA), 8);    /* sub rdx, 8 */
+            p = emit4(emit1(emit1(emit1(p, 0x48), 0x81), 0xFA), (uint32_t)(len - 8));
+            p = emit1(emit1(p, 0x76), 23);
+            p = emit_exit(p, epilogue, pc, k);
+            p = emit_dirty(p, epilogue, pc, k);
+            p = emit_get(p, X_RCX, ip->rA);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x89), 0x0C), 0x14);  /* mov [r12+rdx], rcx */
+            p = emit_put(p, X_RDX, REG_RSP);
+            p = emit_smc(p, epilogue, ip->next_pc, k + 1);
+            break;
+
+        case I_POPQ:
+            p = emit_get(p, X_RDX, REG_RSP);
+            p = emit4(emit1(emit1(emit1(p, 0x48), 0x81), 0xFA), (uint32_t)(len - 8));
+            p = emit1(emit1(p, 0x76), 23);
+            p = emit_exit(p, epilogue, pc, k);
+            p = emit1(emit1(emit1(emit1(p, 0x49), 0x8B), 0x04), 0x14);  /* mov rax, [r12+rdx] */
+            p = emit1(emit1(emit1(emit1(p, 0x48), 0x8D), 0x4A), 8);    /* lea rcx, [rdx+8] */
+            p = emit_put(p, X_RCX, REG_RSP);
+            if (!NONE_REG(ip->rA))
+                p = emit_put(p, X_RAX, ip->rA);
+            break;
+        }
+    }
+    /* Fell off a cut block */
+    if (!ends)
+        p = emit_chain(jit, len, p, epilogue, pc, n);
+
+    /* Chain the exits that were waiting for this block */
+    for (j = k = 0; k < jit->n_patches; k++) {
+        if (jit->patches[k].pc == blk->start)
+            emit4(jit->patches[k].rel,
+                  (uint32_t)(body - (jit->patches[k].rel + 4)));
+        else
+            jit->patches[j++] = jit->patches[k];
+    }
+    jit->n_patches = j;
+
+    jit->used = p - jit->buf;
+    blk->end = pc;
+    blk->len = n;
+    blk->code = (jit_code_t)entry;
+    blk->next = jit->compiled;
+    jit->compiled = blk;
+}
+
+/*
+ * run_jit: execute up to max_steps instructions like run_y64sim(),
+ *     compiling hot blocks and interpreting the rest one step at a time
+ */
+stat_t run_jit(y64sim_t *sim, int max_steps, int *steps)
+{
+    jit_t *jit = sim->jit;
+    jit_state_t *st = &jit->st;
+    jit_block_t *blk;
+    long_t pc, len = sim->m->len;
+    int n = 0, k, at_start = 1;
+    stat_t e = STAT_AOK;
+
+    while (n < max_steps && e == STAT_AOK) {
+        pc = sim->pc;
+        blk = NULL;
+        if (at_start && pc >= 0 && pc < len) {
+            jit_block_t **slot = jit_slot(jit, pc);
+            if (!(blk = *slot)) {
+                blk = (jit_block_t *)calloc(1, sizeof(jit_block_t));
+                blk->start = blk->end = pc;
+                blk->link = jit->blocks;
+                jit->blocks = blk;
+                *slot = blk;
+            }
+            if (!blk->code && blk->count >= 0 && ++blk->count >= JIT_HOT)
+                jit_compile(sim, blk);
+        }
+
+        if (blk && blk->code && blk->len <= max_steps - n) {
+            st->cc_op = sim->cc_op;
+            st->cc_a = sim->cc_a;
+            st->cc_b = sim->cc_b;
+            st->cc_res = sim->cc_res;
+            st->cc = sim->cc;
+            st->executed = 0;
+            st->limit = max_steps - n;
+            st->smc_addr = -1;
+            st->code = sim->code;
+            st->dirty = sim->m->dirty;
+            st->map = jit->map;
+            sim->pc = blk->code((long_t *)sim->r->data, sim->m->data, st);
+            sim->cc = st->cc;
+            sim->cc_op = (alu_t)st->cc_op;
+            sim->cc_a = st->cc_a;
+            sim->cc_b = st->cc_b;
+            sim->cc_res = st->cc_res;
+            n += st->executed;
+            /* Native code stops at block starts, after a store into
+               code, or just before a store to a clean page or a fault.
+               If that was its first instruction, interpret it. */
+            at_start = st->executed != 0;
+            if (st->smc_addr >= 0)
+                invalidate_code(sim, st->smc_addr);
+            continue;
+        }
+
+        e = run_y64sim(sim, 1, &k);
+        n += k;
+        if (e == STAT_AOK && pc >= 0 && pc < len) {
+            int icode = GET_ICODE(find_insn(sim, pc)->codefun);
+            at_start = icode == I_JMP || icode == I_CALL || icode == I_RET;
+        }
+    }
+    *steps = n;
+    return e;
+}
+
+/*
+ * Profiler (-p prefix)
+ *
+ * Steps the program with nexti() and, around each step, notes
+ *     - how often each PC was executed,
+ *     - for conditional jumps, how often they were taken or not,
+ *     - the call stack: call enters the function at its target and ret
+ *       leaves it, and every instruction is charged to the stack it
+ *       ran in; the call graph edges come from the same tree,
+ *     - the loads and stores at each memory address.
+ * prefix.prof gets a flat profile, the call graph and the memory
+ * accesses; prefix.folded gets one "f1;f2;...;fn count" line per
+ * stack, the collapsed format flame graph tools read. Functions are
+ * named by their entry address. A function calling itself stays in one
+ * frame, so deep recursion does not make for huge stacks.
+ */
+
+typedef struct prof_frame {
+    long_t func;                    /* entry address */
+    long_t self;                    /* instructions run in this stack */
+    long_t calls;                   /* times entered from the parent */
+    long_t rec_calls;               /* times it called itself */
+    struct prof_frame *parent, *child, *sibling;
+} prof_frame_t;
+
+typedef struct prof {
+    long_t len;
+    long_t total;
+    long_t *count;                  /* executions per PC */
+    long_t *taken, *not_taken;      /* outcomes of jXX per PC */
+    long_t *loads, *stores;         /* accesses per address */
+    int *pcs, n_pcs, max_pcs;       /* PCs executed */
+    int *addrs, n_addrs, max_addrs; /* addresses accessed */
+    prof_frame_t *root, *cur;
+    prof_frame_t **stack;           /* frames to return to */
+    int depth, max_depth;
+} prof_t;
+
+static const char *prof_names[] = {
+    "halt", "nop", "rrmovq", "irmovq", "rmmovq", "mrmovq", "OPq", "jXX",
+    "call", "ret", "pushq", "popq"
+};
+static const char *prof_alu[] = { "addq", "subq", "andq", "xorq" };
+static const char *prof_cmov[] = {
+    "rrmovq", "cmovle", "cmovl", "cmove", "cmovne", "cmovge", "cmovg"
+};
+static const char *prof_jmp[] = {
+    "jmp", "jle", "jl", "je", "jne", "jge", "jg"
+};
+
+static prof_frame_t *new_frame(prof_frame_t *parent, long_t func)
+{
+    prof_frame_t *f = (prof_frame_t *)calloc(1, sizeof(prof_frame_t));
+
+    f->func = func;
+    f->parent = parent;
+    if (parent) {
+        f->sibling = parent->child;
+        parent->child = f;
+    }
+    return f;
+}
+
+static void free_frames(prof_frame_t *f)
+{
+    prof_frame_t *next;
+
+    for (; f; f = next) {
+        next = f->sibling;
+        free_frames(f->child);
+        free(f);
+    }
+}
+
+static prof_t *new_prof(y64sim_t *sim)
+{
+    prof_t *prof = (prof_t *)calloc(1, sizeof(prof_t));
+
+    prof->len = sim->m->len;
+    prof->count = (long_t *)sparse_alloc(prof->len * sizeof(long_t));
+    prof->taken = (long_t *)sparse_alloc(prof->len * sizeof(long_t));
+    prof->not_taken = (long_t *)sparse_alloc(prof->len * sizeof(long_t));
+    prof->loads = (long_t *)sparse_alloc(prof->len * sizeof(long_t));
+    prof->stores = (long_t *)sparse_alloc(prof->len * sizeof(long_t));
+    prof->root = prof->cur = new_frame(NULL, sim->pc);
+    return prof;
+}
+
+static void free_prof(prof_t *prof)
+{
+    munmap(prof->count, prof->len * sizeof(long_t));
+    munmap(prof->taken, prof->len * sizeof(long_t));
+    munmap(prof->not_taken, prof->len * sizeof(long_t));
+    munmap(prof->loads, prof->len * sizeof(long_t));
+    munmap(prof->stores, prof->len * sizeof(long_t));
+    free(prof->pcs);
+    free(prof->addrs);
+    free_frames(prof->root);
+    free(prof->stack);
+    free(prof);
+}
+
+/*
+ * prof_step: nexti() with the bookkeeping around it
+ */
+static stat_t prof_step(prof_t *prof, y64sim_t *sim)
+{
+    long_t pc = sim->pc, addr = -1, imm = 0;
+    byte_t codefun = 0, regs = 0;
+    bool_t store = FALSE, taken = FALSE;
+    prof_frame_t *f;
+    int icode, ifun;
+    stat_t e;
+
+    get_byte_val(sim->m, pc, &codefun);
+    icode = GET_ICODE(codefun);
+    ifun = GET_FUN(codefun);
+    switch (icode) {
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+        get_byte_val(sim->m, pc + 1, &regs);
+        get_long_val(sim->m, pc + 2, &imm);
+        addr = imm + get_reg_val(sim->r, GET_REGB(regs));
+        store = icode == I_RMMOVQ;
+        break;
+    case I_PUSHQ:
+    case I_CALL:
+        addr = get_reg_val(sim->r, REG_RSP) - 8;
+        store = TRUE;
+        break;
+    case I_POPQ:
+    case I_RET:
+        addr = get_reg_val(sim->r, REG_RSP);
+        break;
+    case I_JMP:
+        taken = ifun != C_YES && cond_doit(get_cc(sim), ifun);
+        break;
+    }
+
+    e = nexti(sim);
+
+    prof->total++;
+    prof->cur->self++;
+    if (pc < 0 || pc >= prof->len)
+        return e;
+    if (!prof->count[pc]++)
+        add_index(&prof->pcs, &prof->n_pcs, &prof->max_pcs, pc);
+    if (e != STAT_AOK)
+        return e;
+
+    if (addr >= 0) {
+        if (!prof->loads[addr] && !prof->stores[addr])
+            add_index(&prof->addrs, &prof->n_addrs, &prof->max_addrs, addr);
+        if (store)
+            prof->stores[addr]++;
+        else
+            prof->loads[addr]++;
+    }
+    if (icode == I_JMP && ifun != C_YES) {
+        if (taken)
+            prof->taken[pc]++;
+        else
+            prof->not_taken[pc]++;
+    } else if (icode == I_CALL) {
+        if (prof->depth == prof->max_depth) {
+            prof->max_depth = prof->max_depth ? 2 * prof->max_depth : 64;
+            prof->stack = (prof_frame_t **)realloc(prof->stack,
+                              prof->max_depth * sizeof(prof_frame_t *));
+        }
+        prof->stack[prof->depth++] = prof->cur;
+        if (prof->cur->func == sim->pc) {
+            prof->cur->rec_calls++;
+        } else {
+            for (f = prof->cur->child; f && f->func != sim->pc;
+                 f = f->sibling)
+                ;
+            prof->cur = f ? f : new_frame(prof->cur, sim->pc);
+            prof->cur->calls++;
+        }
+    } else if (icode == I_RET && prof->depth > 0) {
+        prof->cur = prof->stack[--prof->depth];
+    }
+    return e;
+}
+
+static prof_t *sort_prof;
+
+static int cmp_count(const void *a, const void *b)
+{
+    long_t ca = sort_prof->count[*(const int *)a];
+    long_t cb = sort_prof->count[*(const int *)b];
+
+    if (ca != cb)
+        return ca < cb ? 1 : -1;
+    return *(const int *)a - *(const int *)b;
+}
+
+/* A call graph edge */
+typedef struct prof_edge {
+    long_t caller, callee, calls;
+} prof_edge_t;
+
+static int cmp_edge(const void *a, const void *b)
+{
+    const prof_edge_t *x = (const prof_edge_t *)a, *y = (const prof_edge_t *)b;
+
+    if (x->caller != y->caller)
+        return x->caller < y->caller ? -1 : 1;
+    if (x->callee != y->callee)
+        return x->callee < y->callee ? -1 : 1;
+    return 0;
+}
+
+static void add_edge(prof_edge_t **edges, int *n, int *max,
+                     long_t caller, long_t callee, long_t calls)
+{
+    if (*n == *max) {
+        *max = *max ? 2 * *max : 16;
+        *edges = (prof_edge_t *)realloc(*edges, *max * sizeof(prof_edge_t));
+    }
+    (*edges)[*n].caller = caller;
+    (*edges)[*n].callee = callee;
+    (*edges)[(*n)++].calls = calls;
+}
+
+static void collect_edges(prof_frame_t *f, prof_edge_t **edges, int *n,
+                          int *max)
+{
+    for (; f; f = f->sibling) {
+        if (f->parent)
+            add_edge(edges, n, max, f->parent->func, f->func, f->calls);
+        if (f->rec_calls)
+            add_edge(edges, n, max, f->func, f->func, f->rec_calls);
+        collect_edges(f->child, edges, n, max);
+    }
+}
+
+/* Print the stack of f as "f1;f2;...;fn" */
+static void print_stack(FILE *out, prof_frame_t *f)
+{
+    if (f->parent) {
+        print_stack(out, f->parent);
+        fputc(';', out);
+    }
+    fprintf(out, "0x%lx", f->func);
+}
+
+static void write_folded(FILE *out, prof_frame_t *f)
+{
+    for (; f; f = f->sibling) {
+        if (f->self) {
+            print_stack(out, f);
+            fprintf(out, " %ld\n", f->self);
+        }
+        write_folded(out, f->child);
+    }
+}
+
+/*
+ * write_prof: write prefix.prof and prefix.folded
+ */
+static int write_prof(prof_t *prof, y64sim_t *sim, const char *prefix)
+{
+    char fname[MAX_LINE];
+    prof_edge_t *edges = NULL;
+    int i, j, n = 0, max = 0;
+    long_t pc, cumul = 0;
+    byte_t codefun = 0;
+    const char *name;
+    FILE *out;
+
+    snprintf(fname, sizeof(fname), "%s.prof", prefix);
+    if (!(out = fopen(fname, "w"))) {
+        err_print("Can't write profile '%s'", fname);
+        return -1;
+    }
+
+    fprintf(out, "Flat profile: %ld instructions at %d addresses\n\n",
+            prof->total, prof->n_pcs);
+    fprintf(out, "%12s %7s %7s  %-18s %-8s %12s %12s\n", "count", "%",
+            "cumul%", "address", "insn", "taken", "not taken");
+    sort_prof = prof;
+    qsort(prof->pcs, prof->n_pcs, sizeof(int), cmp_count);
+    for (i = 0; i < prof->n_pcs; i++) {
+        pc = prof->pcs[i];
+        cumul += prof->count[pc];
+        get_byte_val(sim->m, pc, &codefun);
+        j = GET_FUN(codefun);
+        switch (GET_ICODE(codefun)) {
+        case I_RRMOVQ: name = j <= C_G ? prof_cmov[j] : "cmov?"; break;
+        case I_ALU:    name = j <= A_XOR ? prof_alu[j] : "OPq?"; break;
+        case I_JMP:    name = j <= C_G ? prof_jmp[j] : "jXX?"; break;
+        default:
+            name = GET_ICODE(codefun) <= I_POPQ ?
+                prof_names[GET_ICODE(codefun)] : "?";
+        }
+        fprintf(out, "%12ld %7.2f %7.2f  0x%.16lx %-8s", prof->count[pc],
+                100.0 * prof->count[pc] / prof->total,
+                100.0 * cumul / prof->total, pc, name);
+        if (prof->taken[pc] || prof->not_taken[pc])
+            fprintf(out, " %12ld %12ld", prof->taken[pc], prof->not_taken[pc]);
+        fprintf(out, "\n");
+    }
+
+    collect_edges(prof->root, &edges, &n, &max);
+    qsort(edges, n, sizeof(prof_edge_t), cmp_edge);
+    fprintf(out, "\nCall graph: caller -> callee, calls\n\n");
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && !cmp_edge(edges + i, edges + j); j++)
+            edges[i].calls += edges[j].calls;
+        fprintf(out, "0x%.16lx -> 0x%.16lx %12ld\n", edges[i].caller,
+                edges[i].callee, edges[i].calls);
+    }
+    free(edges);
+
+    fprintf(out, "\nMemory accessed: %d addresses\n\n", prof->n_addrs);
+    fprintf(out, "%-18s %12s %12s\n", "address", "loads", "stores");
+    qsort(prof->addrs, prof->n_addrs, sizeof(int), cmp_page);
+    for (i = 0; i < prof->n_addrs; i++) {
+        pc = prof->addrs[i];
+        fprintf(out, "0x%.16lx %12ld %12ld\n", pc, prof->loads[pc],
+                prof->stores[pc]);
+    }
+    fclose(out);
+
+    snprintf(fname, sizeof(fname), "%s.folded", prefix);
+    if (!(out = fopen(fname, "w"))) {
+        err_print("Can't write profile '%s'", fname);
+        return -1;
+    }
+    write_folded(out, prof->root);
+    fclose(out);
+    return 0;
+}
+
+/*
+ * load_file: a new image with fname loaded and checkpointed, or NULL
+ *     if it could not be loaded
+ */
+static y64sim_t *load_file(const char *fname, long mem_size)
+{
+    FILE *binfile;
+    y64sim_t *sim;
+
+    binfile = fopen(fname, "rb");
+    if (!binfile) {
+        err_print("Can't open binary file '%s'", fname);
+        return NULL;
+    }
 
-    sim = new_y64sim(MEM_SIZE);
+    sim = new_y64sim(mem_size);
     if (load_binfile(sim->m, binfile) < 0) {
-        err_print("Failed to load binary file '%s'", argv[1]);
+        err_print("Failed to load binary file '%s'", fname);
+        fclose(binfile);
         free_y64sim(sim);
-        exit(1);
+        return NULL;
     }
     fclose(binfile);
 
-    /* save initial register and memory stat */
-    saver = dup_reg(sim->r);
-    savem = dup_mem(sim->m);
+    /* checkpoint the initial register and memory stat */
+    snapshot_y64sim(sim);
+    return sim;
+}
+
+/*
+ * run_sim: run a checkpointed image and print the results to out, the
+ *     way the simulator reports a single program
+ * args
+ *     mode: 'r' for nexti(), 'j' for the JIT, 0 for the interpreter
+ *
+ * return
+ *     status of the last step
+ */
+static stat_t run_sim(y64sim_t *sim, int max_steps, int mode,
+                      const char *prof_prefix, FILE *out)
+{
+    prof_t *prof = NULL;
+    int step = 0;
+    stat_t e = STAT_AOK;
 
-    /* execute binary code step-by-step */
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-        e = nexti(sim);
+    /* execute binary code */
+    if (prof_prefix) {
+        prof = new_prof(sim);
+        for (step = 0; step < max_steps && e == STAT_AOK; step++)
+            e = prof_step(prof, sim);
+    } else if (mode == 'r') {
+        for (step = 0; step < max_steps && e == STAT_AOK; step++)
+            e = nexti(sim);
+    } else if (mode == 'j') {
+        if (!sim->jit)
+            jit_init(sim);
+        e = run_jit(sim, max_steps, &step);
+    } else {
+        e = run_y64sim(sim, max_steps, &step);
+    }
 
     /* print final stat of y64sim */
-    printf("Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
-            step, sim->pc, stat_name(e), cc_name(sim->cc));
+    fprintf(out, "Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
+            step, sim->pc, stat_name(e), cc_name(get_cc(sim)));
 
-    printf("Changes to registers:\n");
-    diff_reg(saver, sim->r, stdout);
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(sim->snap_r, sim->r, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_mem_snapshot(sim->m, out);
+
+    if (prof) {
+        write_prof(prof, sim, prof_prefix);
+        free_prof(prof);
+    }
+    return e;
+}
 
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, sim->m, stdout);
+/*
+ * run_file: load fname into a new image, run it and print the results
+ *     to out
+ *
+ * return
+ *     status of the last step, or -1 if fname could not be loaded
+ */
+static int run_file(const char *fname, int max_steps, int mode,
+                    long mem_size, const char *prof_prefix, FILE *out)
+{
+    y64sim_t *sim;
+    stat_t e;
 
+    msg_out = out;
+    if (!(sim = load_file(fname, mem_size)))
+        return -1;
+    e = run_sim(sim, max_steps, mode, prof_prefix, out);
     free_y64sim(sim);
-    free_reg(saver);
-    free_mem(savem);
+    return e;
+}
+
+/*
+ * Batch mode (-b manifest)
+ *
+ * Each line of the manifest names a .bin file and optionally a step
+ * limit; blank lines and lines starting with '#' are skipped. Worker
+ * threads take the programs in turn, each on an image of its own, and
+ * collect what the program would have printed. The results then come
+ * out in manifest order, each as one header line followed by exactly
+ * that output:
+ *
+ *     @job <index> <file> <max_steps> <status> <bytes>
+ *
+ * where status is AOK, HLT, ADR, INS, or ERR if the file could not be
+ * loaded, and bytes is the length of the output that follows.
+ *
+ * The jobs are handed out grouped by file, and a worker given the file
+ * it ran last goes back to that image's checkpoint (restore_y64sim())
+ * instead of loading it again, keeping what was decoded or compiled.
+ */
+
+
+typedef struct job {
+    char *fname;
+    int max_steps;
+    int status;
+    char *buf;              /* output of the run */
+    size_t len;
+} job_t;
+
+typedef struct batch {
+    job_t *jobs;
+    int n_jobs;
+    int *order;             /* job indices, grouped by file */
+    int next_job;           /* index into order, taken atomically */
+    int mode;
+    long mem_size;
+} batch_t;
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = (batch_t *)arg;
+    y64sim_t *sim = NULL;
+    const char *loaded = NULL;  /* file in sim */
+    job_t *job;
+    FILE *out;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&b->next_job, 1)) < b->n_jobs) {
+        job = b->jobs + b->order[i];
+        out = open_memstream(&job->buf, &job->len);
+        msg_out = out;
+        if (sim && !strcmp(loaded, job->fname)) {
+            restore_y64sim(sim);
+        } else {
+            if (sim)
+                free_y64sim(sim);
+            sim = load_file(job->fname, b->mem_size);
+            loaded = job->fname;
+        }
+        job->status = sim ? run_sim(sim, job->max_steps, b->mode, NULL, out)
+                          : -1;
+        fclose(out);
+    }
+    if (sim)
+        free_y64sim(sim);
+    return NULL;
+}
+
+static job_t *sort_jobs;
+
+static int cmp_job(const void *a, const void *b)
+{
+    int ia = *(const int *)a, ib = *(const int *)b;
+    int c = strcmp(sort_jobs[ia].fname, sort_jobs[ib].fname);
+
+    return c ? c : ia - ib;
+}
+
+/*
+ * read_manifest: the jobs listed in fname, "-" for stdin
+ */
+static int read_manifest(const char *fname, job_t **jobs)
+{
+    char line[MAX_LINE], name[MAX_LINE];
+    FILE *f = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+    int n = 0, max = 0, steps, fields;
+
+    if (!f) {
+        err_print("Can't open manifest '%s'", fname);
+        exit(1);
+    }
+    *jobs = NULL;
+    while (fgets(line, MAX_LINE, f)) {
+        fields = sscanf(line, "%1023s %d", name, &steps);
+        if (fields < 1 || name[0] == '#')
+            continue;
+        if (n == max) {
+            max = max ? 2 * max : 64;
+            *jobs = (job_t *)realloc(*jobs, max * sizeof(job_t));
+        }
+        (*jobs)[n].fname = strdup(name);
+        (*jobs)[n].max_steps = fields > 1 ? steps : MAX_STEP;
+        (*jobs)[n].buf = NULL;
+        (*jobs)[n].len = 0;
+        n++;
+    }
+    if (f != stdin)
+        fclose(f);
+    return n;
+}
+
+static int run_batch(const char *manifest, int n_threads, int mode,
+                     long mem_size)
+{
+    pthread_t *tids;
+    batch_t b;
+    job_t *job;
+    int i;
+
+    b.n_jobs = read_manifest(manifest, &b.jobs);
+    b.order = (int *)malloc((b.n_jobs + 1) * sizeof(int));
+    for (i = 0; i < b.n_jobs; i++)
+        b.order[i] = i;
+    sort_jobs = b.jobs;
+    qsort(b.order, b.n_jobs, sizeof(int), cmp_job);
+    b.next_job = 0;
+    b.mode = mode;
+    b.mem_size = mem_size;
+    if (n_threads > b.n_jobs)
+        n_threads = b.n_jobs > 0 ? b.n_jobs : 1;
+
+    tids = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+    for (i = 0; i < n_threads; i++)
+        if (pthread_create(&tids[i], NULL, batch_worker, &b)) {
+            err_print("Can't create worker thread %d", i);
+            exit(1);
+        }
+    for (i = 0; i < n_threads; i++)
+        pthread_join(tids[i], NULL);
+
+    for (i = 0; i < b.n_jobs; i++) {
+        job = b.jobs + i;
+        printf("@job %d %s %d %s %lu\n", i, job->fname, job->max_steps,
+               job->status < 0 ? "ERR" : stat_name(job->status),
+               (unsigned long)job->len);
+        fwrite(job->buf, 1, job->len, stdout);
+        free(job->buf);
+        free(job->fname);
+    }
+    free(b.jobs);
+    free(b.order);
+    free(tids);
+    return 0;
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-r|-j|-p prefix] [-m size] file.bin [max_steps]\n", pname);
+    printf("   Or: %s [-r|-j] [-m size] -b manifest [-t threads]\n", pname);
+    printf("  -r  step with the reference nexti() instead of the\n"
+           "      pre-decoded interpreter\n");
+    printf("  -j  compile hot basic blocks to x86-64\n");
+    printf("  -m  memory size in bytes, or with a K or M suffix\n"
+           "      (default 0x%x, at most 0x%x)\n", MEM_SIZE, MEM_MAX_SIZE);
+    printf("  -b  run the programs listed in manifest, one \"file.bin\n"
+           "      [max_steps]\" per line, and print each result after\n"
+           "      an \"@job index file max_steps status bytes\" line\n");
+    printf("  -t  worker threads for -b (default: one per CPU)\n");
+    printf("  -p  step with nexti() and write a profile to prefix.prof\n"
+           "      and collapsed stacks to prefix.folded\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_steps = MAX_STEP;
+    int mode = 0, n_threads = 0;
+    long mem_size = MEM_SIZE;
+    char *fname, *pname = argv[0], *end, *manifest = NULL, *prof_prefix = NULL;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-r") || !strcmp(argv[1], "-j")) {
+            mode = argv[1][1];
+        } else if (!strcmp(argv[1], "-m") && argc > 2) {
+            mem_size = strtol(argv[2], &end, 0);
+            if (*end == 'k' || *end == 'K')
+                mem_size <<= 10, end++;
+            else if (*end == 'm' || *end == 'M')
+                mem_size <<= 20, end++;
+            if (*end || mem_size <= 0 || mem_size > MEM_MAX_SIZE)
+                usage(pname);
+            argv++;
+            argc--;
+        } else if (!strcmp(argv[1], "-b") && argc > 2) {
+            manifest = argv[2];
+            argv++;
+            argc--;
+        } else if (!strcmp(argv[1], "-p") && argc > 2) {
+            prof_prefix = argv[2];
+            argv++;
+            argc--;
+        } else if (!strcmp(argv[1], "-t") && argc > 2) {
+            n_threads = atoi(argv[2]);
+            if (n_threads <= 0)
+                usage(pname);
+            argv++;
+            argc--;
+        } else {
+            usage(pname);
+        }
+        argv++;
+        argc--;
+    }
+    argv[0] = pname;
+
+    if (manifest) {
+        if (argc != 1 || prof_prefix)
+            usage(pname);
+        if (!n_threads)
+            n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        return run_batch(manifest, n_threads > 0 ? n_threads : 1, mode,
+                         mem_size);
+    }
+
+    if (argc < 2 || argc > 3)
+        usage(argv[0]);
+
+    /* set max steps */
+    if (argc > 2)
+        max_steps = atoi(argv[2]);
+
+    /* load binary file to memory */
+    fname = argv[1];
+    if (strlen(fname) < 4 || strcmp(fname+(strlen(fname)-4), ".bin"))
+        usage(argv[0]); /* only support *.bin file */
+
+    if (run_file(fname, max_steps, mode, mem_size, prof_prefix, stdout) < 0)
+        exit(1);
 
     return 0;
 }
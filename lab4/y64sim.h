@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
@@ -10,6 +11,11 @@
 
 #define BLK_SIZE 32
 #define MEM_SIZE (1<<13)
+#define MEM_MAX_SIZE (1<<30)    /* largest memory for -m */
+
+/* Memory is reserved in full but only backed where touched */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1<<MEM_PAGE_SHIFT)
 #define REG_SIZE 15*8
 
 typedef unsigned char byte_t;
@@ -69,14 +75,46 @@ typedef enum { D_DATA, D_POS, D_ALIGN } dtv_t;
 
 typedef struct mem {
     int len;
-    byte_t *data;
+    byte_t *data;       /* len bytes mmap'ed, zero-filled on demand */
+    byte_t *touched;    /* one flag per page, set once written */
+    int *pages;         /* the pages written, in that order */
+    int n_pages, max_pages;
+    byte_t *dirty;      /* one flag per page, set once written since
+                           the snapshot (or since init without one) */
+    int *dirty_pages;   /* the pages flagged dirty */
+    int n_dirty, max_dirty;
+    bool_t snapped;     /* a snapshot is kept */
+    byte_t **saved;     /* per dirty page, its contents at the snapshot */
+    byte_t **spare;     /* saved copies to reuse */
+    int n_spare, max_spare;
+    long_t tlb;         /* last page written, if whole: known to be
+                           dirty and in range */
 } mem_t;
 
+/* Pre-decoded instruction, one per byte address of memory that runs */
+typedef struct insn {
+    void *handler;      /* label of the interpreter, NULL if not decoded */
+    byte_t rA, rB;      /* registers read; REG_NONE reads as zero */
+    byte_t wA, wB;      /* registers written; REG_NONE goes to a sink */
+    byte_t fun;
+    byte_t codefun;     /* first byte, for error messages */
+    long_t imm;
+    long_t next_pc;
+} insn_t;
+
 typedef struct y64sim {
     long_t pc;
     mem_t *r;
     mem_t *m;
-    cc_t cc;
+    cc_t cc;            /* current unless cc_op is pending */
+    alu_t cc_op;        /* last ALU op, A_NONE once cc is computed */
+    long_t cc_a, cc_b, cc_res;  /* its compute_cc() arguments */
+    insn_t **dec;       /* per page, its records; NULL until it runs */
+    byte_t *code;       /* m->len flags, set on bytes of decoded code */
+    struct jit *jit;    /* JIT state, NULL unless compiling */
+    mem_t *snap_r;      /* registers, PC and CC at the snapshot */
+    long_t snap_pc;
+    cc_t snap_cc;
 } y64sim_t;
 
 #endif
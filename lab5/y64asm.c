@@ -2,24 +2,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "y64asm.h"
 
+/*
+ * The state of the parse is per thread, so that parts of the source
+ * can be assembled side by side (-t); cur_part is NULL when the whole
+ * file is assembled in one go.
+ */
+char *src_buf = NULL; /* the whole source, lines point into it */
 line_t *line_head = NULL;
 line_t *line_tail = NULL;
-int lineno = 0;
-int64_t maxDest = 0;
-int maxDestLineNo = 0;
+__thread int lineno = 0;
+__thread int64_t maxDest = 0;
+__thread int maxDestLineNo = 0;
+__thread part_t *cur_part = NULL;
+__thread FILE *msg_out = NULL; /* stderr if NULL */
 
 #define err_print(_s, _a ...) do { \
   if (lineno < 0) \
-    fprintf(stderr, "[--]: "_s"\n", ## _a); \
+    fprintf(msg_out ? msg_out : stderr, "[--]: "_s"\n", ## _a); \
   else \
-    fprintf(stderr, "[L%d]: "_s"\n", lineno, ## _a); \
+    fprintf(msg_out ? msg_out : stderr, "[L%d]: "_s"\n", lineno, ## _a); \
 } while (0);
 
 
-int64_t vmaddr = 0;    /* vm addr */
+__thread int64_t vmaddr = 0;    /* vm addr */
 
 /* register table */
 const reg_t reg_table[REG_NONE] = {
@@ -39,16 +49,49 @@ const reg_t reg_table[REG_NONE] = {
     {"%r13", REG_R13, 4},
     {"%r14", REG_R14, 4}
 };
+
+/*
+ * find_register: recognize the register at the start of 'name'
+ *     with a switch over its letters, then compare the one candidate
+ *
+ * return
+ *     reg_t: the register
+ *     NULL: not a register
+ */
 const reg_t* find_register(char *name)
 {
-    int i;
-    for (i = 0; i < REG_NONE; i++)
-        if (!strncmp(name, reg_table[i].name, reg_table[i].namelen))
-            return &reg_table[i];
-    return NULL;
+    regid_t id;
+
+    if (name[0] != '%' || name[1] != 'r')
+        return NULL;
+    switch (name[2]) {
+    case 'a': id = REG_RAX; break;
+    case 'c': id = REG_RCX; break;
+    case 'd': id = name[3] == 'x' ? REG_RDX : REG_RDI; break;
+    case 'b': id = name[3] == 'x' ? REG_RBX : REG_RBP; break;
+    case 's': id = name[3] == 'p' ? REG_RSP : REG_RSI; break;
+    case '8': id = REG_R8; break;
+    case '9': id = REG_R9; break;
+    case '1':
+        if (name[3] < '0' || name[3] > '4')
+            return NULL;
+        id = REG_R10 + (name[3] - '0');
+        break;
+    default:
+        return NULL;
+    }
+    if (strncmp(name, reg_table[id].name, reg_table[id].namelen))
+        return NULL;
+    return &reg_table[id];
 }
 
 
+/* positions in instr_set: cmovXX and jXX follow cond_t, OPq follows alu_t */
+enum { IX_NOP, IX_HALT, IX_RRMOVQ, IX_IRMOVQ = IX_RRMOVQ + C_G + 1,
+    IX_RMMOVQ, IX_MRMOVQ, IX_ALU, IX_JMP = IX_ALU + A_NONE,
+    IX_CALL = IX_JMP + C_G + 1, IX_RET, IX_PUSHQ, IX_POPQ, IX_BYTE,
+    IX_WORD, IX_LONG, IX_QUAD, IX_POS, IX_ALIGN };
+
 /* instruction set */
 instr_t instr_set[] = {
     {"nop", 3,   HPACK(I_NOP, F_NONE), 1 },
@@ -87,13 +130,82 @@ instr_t instr_set[] = {
     {NULL, 1,    0   , 0 } //end
 };
 
+/* the condition that ends a cmovXX or jXX at 's', C_YES if none */
+static cond_t find_cond(const char *s)
+{
+    switch (s[0]) {
+    case 'l': return s[1] == 'e' ? C_LE : C_L;
+    case 'e': return C_E;
+    case 'n': return s[1] == 'e' ? C_NE : C_YES;
+    case 'g': return s[1] == 'e' ? C_GE : C_G;
+    default:  return C_YES;
+    }
+}
+
+/*
+ * find_instr: recognize the instruction at the start of 'name' with a
+ *     switch over its letters, then compare the one candidate; where a
+ *     name is a prefix of another (jl, jle) the longer one wins
+ *
+ * return
+ *     instr_t: the instruction
+ *     NULL: not an instruction
+ */
 instr_t *find_instr(char *name)
 {
+    cond_t cond;
     int i;
-    for (i = 0; instr_set[i].name; i++)
-	if (strncmp(instr_set[i].name, name, instr_set[i].len) == 0)
-	    return &instr_set[i];
-    return NULL;
+
+    switch (name[0]) {
+    case 'n': i = IX_NOP; break;
+    case 'h': i = IX_HALT; break;
+    case 'i': i = IX_IRMOVQ; break;
+    case 'm': i = IX_MRMOVQ; break;
+    case 'a': i = name[1] == 'n' ? IX_ALU + A_AND : IX_ALU + A_ADD; break;
+    case 's': i = IX_ALU + A_SUB; break;
+    case 'x': i = IX_ALU + A_XOR; break;
+    case 'r':
+        if (name[1] == 'r')
+            i = IX_RRMOVQ;
+        else
+            i = name[1] == 'm' ? IX_RMMOVQ : IX_RET;
+        break;
+    case 'c':
+        if (name[1] == 'a') {
+            i = IX_CALL;
+            break;
+        }
+        if (strncmp(name, "cmov", 4) || (cond = find_cond(name + 4)) == C_YES)
+            return NULL;
+        i = IX_RRMOVQ + cond;
+        break;
+    case 'j':
+        if (name[1] == 'm') {
+            i = IX_JMP;
+            break;
+        }
+        if ((cond = find_cond(name + 1)) == C_YES)
+            return NULL;
+        i = IX_JMP + cond;
+        break;
+    case 'p': i = name[1] == 'u' ? IX_PUSHQ : IX_POPQ; break;
+    case '.':
+        switch (name[1]) {
+        case 'b': i = IX_BYTE; break;
+        case 'w': i = IX_WORD; break;
+        case 'l': i = IX_LONG; break;
+        case 'q': i = IX_QUAD; break;
+        case 'p': i = IX_POS; break;
+        case 'a': i = IX_ALIGN; break;
+        default:  return NULL;
+        }
+        break;
+    default:
+        return NULL;
+    }
+    if (strncmp(instr_set[i].name, name, instr_set[i].len))
+        return NULL;
+    return &instr_set[i];
 }
 
 
@@ -115,11 +227,129 @@ int find(const char *begin, char target)
 }
 
 
-/* symbol table (don't forget to init and finit it) */
-symbol_t *symtab = NULL;
+/* arena for lines, symbols, relocations and symbol names */
+__thread chunk_t *arena = NULL;
+#define CHUNK_SIZE (1 << 16)
 
 /*
- * find_symbol: scan table to find the symbol
+ * arena_alloc: allocate zeroed memory that lives until finit
+ * args
+ *     size: the number of bytes
+ *
+ * return
+ *     the memory, aligned for any record type
+ */
+void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (!arena || arena->used + size > arena->size)
+    {
+        size_t csize = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        chunk_t *c = (chunk_t *)malloc(sizeof(chunk_t) + csize);
+        c->next = arena;
+        c->size = csize;
+        c->used = 0;
+        arena = c;
+    }
+    void *p = arena->data + arena->used;
+    arena->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+/* release all the arena at once */
+void arena_free(void)
+{
+    chunk_t *next;
+    for (; arena; arena = next)
+    {
+        next = arena->next;
+        free(arena);
+    }
+}
+
+/*
+ * symbol table (don't forget to init and finit it): open addressing
+ * over symbol pointers, kept at most half full; names are interned,
+ * so each name has a single symbol_t whether or not it is defined yet
+ */
+__thread symbol_t **symtab = NULL;
+__thread int symtab_size = 0;
+__thread int symtab_count = 0;
+
+static unsigned int hash_name(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (byte_t)name[i]) * 16777619u;
+    return h;
+}
+
+static void grow_symtab(void)
+{
+    symbol_t **old = symtab;
+    int i, j, old_size = symtab_size;
+
+    symtab_size = old_size ? 2 * old_size : 1024;
+    symtab = (symbol_t **)calloc(symtab_size, sizeof(symbol_t *));
+    for (i = 0; i < old_size; i++)
+    {
+        if (!old[i])
+            continue;
+        for (j = old[i]->hash & (symtab_size - 1); symtab[j];
+             j = (j + 1) & (symtab_size - 1))
+            ;
+        symtab[j] = old[i];
+    }
+    free(old);
+}
+
+/* the slot of a name in a table: its symbol, or the empty slot for it */
+static symbol_t **probe_symtab(symbol_t **tab, int size,
+                               const char *name, int len, unsigned int h)
+{
+    symbol_t *sym;
+    int i;
+
+    for (i = h & (size - 1); (sym = tab[i]); i = (i + 1) & (size - 1))
+        if (sym->hash == h && sym->len == len && !memcmp(sym->name, name, len))
+            break;
+    return &tab[i];
+}
+
+/*
+ * intern_symbol: find the symbol of a name, creating it if needed
+ * args
+ *     name: the start of the name (need not be null-terminated)
+ *     len: the length of the name
+ *
+ * return
+ *     symbol_t: the symbol, undefined if it is new
+ */
+symbol_t *intern_symbol(const char *name, int len)
+{
+    unsigned int h = hash_name(name, len);
+    symbol_t **slot, *sym;
+
+    if (2 * (symtab_count + 1) > symtab_size)
+        grow_symtab();
+    slot = probe_symtab(symtab, symtab_size, name, len, h);
+    if (*slot)
+        return *slot;
+
+    sym = (symbol_t *)arena_alloc(sizeof(symbol_t));
+    sym->name = (char *)arena_alloc(len + 1);
+    memcpy(sym->name, name, len);
+    sym->len = len;
+    sym->hash = h;
+    *slot = sym;
+    symtab_count++;
+    return sym;
+}
+
+/*
+ * find_symbol: look up a defined symbol
  * args
  *     name: the name of symbol
  *
@@ -129,68 +359,95 @@ symbol_t *symtab = NULL;
  */
 symbol_t *find_symbol(char *name)
 {
-    symbol_t *current = symtab->next;
-    while(current)
-    {
-        if(strcmp(current->name, name) == 0)
-            return current;
-        current = current->next;
-    }
-    return NULL;
+    int len = strlen(name);
+    symbol_t *sym;
+
+    if (!symtab_size)
+        return NULL;
+    sym = *probe_symtab(symtab, symtab_size, name, len, hash_name(name, len));
+    return sym && sym->defined ? sym : NULL;
 }
 
 /*
- * add_symbol: add a new symbol to the symbol table
+ * add_symbol: define a symbol at the current address
  * args
- *     name: the name of symbol
+ *     sym: the interned symbol
  *
  * return
  *     0: success
  *     -1: error, the symbol has exist
  */
-int add_symbol(char *name)
+int add_symbol(symbol_t *sym)
 {
     /* check duplicate */
-    if(find_symbol(name))
+    if(sym->defined)
     {
-        err_print("Dup symbol:%s", name);
+        err_print("Dup symbol:%s", sym->name);
         return -1;
     }
-    /* create new symbol_t (don't forget to free it)*/
-    symbol_t *new = (symbol_t*)malloc(sizeof(symbol_t));
-    memset(new, 0, sizeof(symbol_t));
-
-    new->name = (char*)malloc(MAX_INSLEN);
-    memset(new->name, 0, MAX_INSLEN);
+    sym->defined = TRUE;
+    sym->addr = vmaddr;
 
-    strcpy(new->name, name);
-    new->addr = vmaddr;
+    /* in a part the address is an offset in the current segment */
+    if (cur_part)
+    {
+        part_t *p = cur_part;
+        if (p->nlabels == p->maxlabels)
+        {
+            p->maxlabels = p->maxlabels ? 2 * p->maxlabels : 256;
+            p->labels = (label_t *)realloc(p->labels,
+                                           p->maxlabels * sizeof(label_t));
+        }
+        p->labels[p->nlabels].sym = sym;
+        p->labels[p->nlabels].seg = p->nsegs - 1;
+        p->labels[p->nlabels++].lineno = lineno;
+    }
+    return 0;
+}
 
-    /* add the new symbol_t to symbol table */
-    new->next = symtab->next;
-    symtab->next = new;
+/*
+ * start_segment: in a part, start a new segment at 'line'
+ * args
+ *     relative: FALSE for .pos, the offsets that follow are absolute
+ *     align: the .align that starts it, 0 if none
+ */
+void start_segment(line_t *line, bool_t relative, int64_t align)
+{
+    part_t *p = cur_part;
+    segment_t *seg;
 
-    return 0;
+    if (!p)
+        return;
+    if (p->nsegs == p->maxsegs)
+    {
+        p->maxsegs = p->maxsegs ? 2 * p->maxsegs : 16;
+        p->segs = (segment_t *)realloc(p->segs,
+                                       p->maxsegs * sizeof(segment_t));
+    }
+    seg = &p->segs[p->nsegs++];
+    seg->first = line;
+    seg->relative = relative;
+    seg->align = align;
+    seg->start = vmaddr;
+    seg->base = 0;
 }
 
+/* are addresses offsets from a base not yet known? */
+#define IS_RELATIVE() (cur_part && cur_part->segs[cur_part->nsegs - 1].relative)
+
 /* relocation table (don't forget to init and finit it) */
-reloc_t *reltab = NULL;
+__thread reloc_t *reltab = NULL;
 
 /*
  * add_reloc: add a new relocation to the relocation table
  * args
- *     name: the name of symbol
+ *     sym: the interned symbol
  */
-void add_reloc(char *name, bin_t *bin)
+void add_reloc(symbol_t *sym, bin_t *bin)
 {
-    /* create new reloc_t (don't forget to free it)*/
-    reloc_t *new = (reloc_t*)malloc(sizeof(reloc_t));
-    memset(new, 0, sizeof(reloc_t));
-
-    new->name = (char*)malloc(MAX_INSLEN);
-    memset(new->name, 0, MAX_INSLEN);
+    reloc_t *new = (reloc_t*)arena_alloc(sizeof(reloc_t));
 
-    strcpy(new->name, name);
+    new->sym = sym;
     new->y64bin = bin;
     
     /* add the new reloc_t to relocation table */
@@ -304,32 +561,27 @@ parse_t parse_reg(char **ptr, regid_t *regid)
  * parse_symbol: parse an expected symbol token (e.g., 'Main')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     sym: point to the interned symbol
  *
  * return
  *     PARSE_SYMBOL: success, move 'ptr' to the first char after token,
- *                               and allocate and store name to 'name'
- *     PARSE_ERR: error, the value of 'ptr' and 'name' are undefined
+ *                               and store the symbol to 'sym'
+ *     PARSE_ERR: error, the value of 'ptr' and 'sym' are undefined
  */
-parse_t parse_symbol(char **ptr, char **name)
+parse_t parse_symbol(char **ptr, symbol_t **sym)
 {
     /* skip the blank and check */
     SKIP_BLANK(*ptr);
+    char *start = *ptr;
 
-    /* allocate name and copy to it */
-    *name = (char*)malloc(MAX_INSLEN);
-    memset(*name, 0, MAX_INSLEN);
-    char *curLetter = *name;
-
-    /* set 'ptr' and 'name' */
+    /* set 'ptr' and 'sym' */
     while(**ptr != ' ' && **ptr != '\t' && **ptr != ',' && **ptr != '(' && **ptr != 0)
     {
         // if(!IS_LETTER(*ptr))
         //     return PARSE_ERR;
-        *curLetter = **ptr;
-        curLetter += 1;
         *ptr += 1;
     }
+    *sym = intern_symbol(start, *ptr - start);
     return PARSE_SYMBOL;
 }
 
@@ -384,7 +636,7 @@ parse_t parse_digit(char **ptr, long *value)
  * parse_imm: parse an expected immediate token (e.g., '$0x100' or 'STACK')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     sym: point to the interned symbol
  *     value: point to the value of digit
  *
  * return
@@ -393,10 +645,10 @@ parse_t parse_digit(char **ptr, long *value)
  *                            and store the value of digit to 'value'
  *     PARSE_SYMBOL: success, the immediate token is a symbol,
  *                            move 'ptr' to the first char after token,
- *                            and allocate and store name to 'name' 
- *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
+ *                            and store the symbol to 'sym'
+ *     PARSE_ERR: error, the value of 'ptr', 'sym' and 'value' are undefined
  */
-parse_t parse_imm(char **ptr, char **name, long *value)
+parse_t parse_imm(char **ptr, symbol_t **sym, long *value)
 {
     /* skip the blank and check */
     SKIP_BLANK(*ptr);
@@ -417,7 +669,7 @@ parse_t parse_imm(char **ptr, char **name, long *value)
     /* if IS_LETTER, then parse the symbol */
     if(IS_LETTER(*ptr))
     {
-        if(parse_symbol(ptr, name) == PARSE_ERR)
+        if(parse_symbol(ptr, sym) == PARSE_ERR)
         {
             err_print("Invalid Immediate");
             return PARSE_ERR;
@@ -426,7 +678,7 @@ parse_t parse_imm(char **ptr, char **name, long *value)
             return PARSE_SYMBOL;
     }
     
-    /* set 'ptr' and 'name' or 'value' */
+    /* set 'ptr' and 'sym' or 'value' */
     SKIP_BLANK(*ptr);
     return PARSE_ERR;
 }
@@ -469,7 +721,7 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  * parse_data: parse an expected data token (e.g., '0x100' or 'array')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     sym: point to the interned symbol
  *     value: point to the value of digit
  *
  * return
@@ -478,10 +730,10 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  *                            and store the value of digit to 'value'
  *     PARSE_SYMBOL: success, data token is a symbol,
  *                            and move 'ptr' to the first char after token,
- *                            and allocate and store name to 'name' 
- *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
+ *                            and store the symbol to 'sym'
+ *     PARSE_ERR: error, the value of 'ptr', 'sym' and 'value' are undefined
  */
-parse_t parse_data(char **ptr, char **name, long *value)
+parse_t parse_data(char **ptr, symbol_t **sym, long *value)
 {
     /* skip the blank and check */
     SKIP_BLANK(*ptr);
@@ -492,9 +744,9 @@ parse_t parse_data(char **ptr, char **name, long *value)
 
     /* if IS_LETTER, then parse the symbol */
     if(IS_LETTER(*ptr))
-        return parse_symbol(ptr, name);
+        return parse_symbol(ptr, sym);
 
-    /* set 'ptr', 'name' and 'value' */
+    /* set 'ptr', 'sym' and 'value' */
 
     return PARSE_ERR;
 }
@@ -503,14 +755,14 @@ parse_t parse_data(char **ptr, char **name, long *value)
  * parse_label: parse an expected label token (e.g., 'Loop:')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     sym: point to the interned symbol
  *
  * return
  *     PARSE_LABEL: success, move 'ptr' to the first char after token
- *                            and allocate and store name to 'name'
+ *                            and store the defined symbol to 'sym'
  *     PARSE_ERR: error, the value of 'ptr' is undefined
  */
-parse_t parse_label(char **ptr, char **name)
+parse_t parse_label(char **ptr, symbol_t **sym)
 {
     /* skip the blank and check */
     SKIP_BLANK(*ptr);
@@ -519,15 +771,11 @@ parse_t parse_label(char **ptr, char **name)
     if(pos <= 0)
         return PARSE_ERR;
 
-    /* allocate name and copy to it */
-    *name = (char*)malloc(MAX_INSLEN);
-    memset(*name, 0, MAX_INSLEN);
-    strncpy(*name, *ptr, pos);
-
-    if(add_symbol(*name) < 0)
+    *sym = intern_symbol(*ptr, pos);
+    if(add_symbol(*sym) < 0)
         return PARSE_ERR;
 
-    /* set 'ptr' and 'name' */
+    /* set 'ptr' and 'sym' */
     *ptr += pos + 1;
     SKIP_BLANK(*ptr);
 
@@ -569,14 +817,12 @@ type_t parse_line(line_t *line)
     /* is a label ? */
     if(find(linePtr, ':') >= 0)
     {
-        char *name;
-        if(parse_label(&linePtr, &name) == PARSE_ERR)
+        symbol_t *label;
+        if(parse_label(&linePtr, &label) == PARSE_ERR)
         {
             line->type = TYPE_ERR;
             return TYPE_ERR;
         }
-        if(name)
-            free(name);
         
         if(IS_END(linePtr) || IS_COMMENT(linePtr))
         {
@@ -596,7 +842,7 @@ type_t parse_line(line_t *line)
         regid_t regA = REG_NONE, regB = REG_NONE;
         int64_t immed = 0;
         int64_t *immedPos = NULL;
-        char* sym = NULL;
+        symbol_t *sym = NULL;
         parse_t parseResult = PARSE_ERR;
         switch (icode)
         {
@@ -729,6 +975,7 @@ type_t parse_line(line_t *line)
                     line->type = TYPE_ERR;
                     return TYPE_ERR;
                 }
+                start_segment(line, FALSE, 0);
                 vmaddr = immed;
                 break;
             case D_ALIGN:
@@ -737,6 +984,13 @@ type_t parse_line(line_t *line)
                     line->type = TYPE_ERR;
                     return TYPE_ERR;
                 }
+                if(IS_RELATIVE())
+                {
+                    /* aligned once the base is known */
+                    start_segment(line, TRUE, immed);
+                    vmaddr = 0;
+                    break;
+                }
                 if(vmaddr % immed == 0)
                     break;
                 vmaddr = ((int64_t)(vmaddr/immed) + 1)*immed;
@@ -748,8 +1002,6 @@ type_t parse_line(line_t *line)
             (line->y64bin).bytes = inst->bytes;
             (line->y64bin).addr = vmaddr;
             vmaddr += (line->y64bin).bytes;
-            if(sym)
-                free(sym);
             return TYPE_INS;
         default:
             break;
@@ -759,9 +1011,6 @@ type_t parse_line(line_t *line)
         (line->y64bin).bytes = inst->bytes;
         (line->y64bin).addr = vmaddr;
         vmaddr += (line->y64bin).bytes;
-
-        if(sym)
-            free(sym);
         return TYPE_INS;
     }
 
@@ -776,6 +1025,48 @@ type_t parse_line(line_t *line)
     return line->type;
 }
 
+/*
+ * read_source: read the whole file into src_buf, lines are kept as
+ *     slices of it
+ *
+ * return
+ *     the length of the source
+ */
+size_t read_source(FILE *in)
+{
+    size_t size, len = 0, n;
+    struct stat st;
+
+    size = fstat(fileno(in), &st) == 0 && st.st_size > 0 ? st.st_size : 4096;
+    src_buf = (char *)malloc(size + 1); // free in finit
+    while ((n = fread(src_buf + len, 1, size - len, in)) > 0) {
+        len += n;
+        if (len == size) {
+            size *= 2;
+            src_buf = (char *)realloc(src_buf, size + 1);
+        }
+    }
+    src_buf[len] = '\0';
+    return len;
+}
+
+/*
+ * cut_line: terminate the line at 'p', which must be before 'end'
+ *
+ * return
+ *     the start of the next line
+ */
+static char *cut_line(char *p, char *end)
+{
+    char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+        nl = end;
+    *nl = '\0';
+    if (nl > p && nl[-1] == '\r')
+        nl[-1] = '\0'; /* replace terminator */
+    return nl + 1;
+}
+
 /*
  * assemble: assemble an y64 file (e.g., 'asum.ys')
  * args
@@ -787,27 +1078,17 @@ type_t parse_line(line_t *line)
  */
 int assemble(FILE *in)
 {
-    static char asm_buf[MAX_INSLEN]; /* the current line of asm code */
     line_t *line;
-    int slen;
-    char *y64asm;
-
-    /* read y64 code line-by-line, and parse them to generate raw y64 binary code list */
-    while (fgets(asm_buf, MAX_INSLEN, in) != NULL) {
-        slen  = strlen(asm_buf);
-        while ((asm_buf[slen-1] == '\n') || (asm_buf[slen-1] == '\r')) { 
-            asm_buf[--slen] = '\0'; /* replace terminator */
-        }
-
-        /* store y64 assembly code */
-        y64asm = (char *)malloc(sizeof(char) * (slen + 1)); // free in finit
-        strcpy(y64asm, asm_buf);
+    char *p, *end, *next;
+    size_t len = read_source(in);
 
-        line = (line_t *)malloc(sizeof(line_t)); // free in finit
-        memset(line, '\0', sizeof(line_t));
+    /* parse them line-by-line to generate raw y64 binary code list */
+    for (p = src_buf, end = src_buf + len; p < end; p = next) {
+        next = cut_line(p, end);
 
+        line = (line_t *)arena_alloc(sizeof(line_t));
         line->type = TYPE_COMM;
-        line->y64asm = y64asm;
+        line->y64asm = p;
         line->next = NULL;
 
         line_tail->next = line;
@@ -848,13 +1129,12 @@ int relocate(void)
     while (rtmp)
     {
         /* find symbol */
-        symb = NULL;
-        symb = find_symbol(rtmp->name);
+        symb = rtmp->sym;
 
-        if(!symb)
+        if(!symb->defined)
         {
             lineno = -1;
-            err_print("Unknown symbol:'%s'", rtmp->name);
+            err_print("Unknown symbol:'%s'", symb->name);
             return -1;
         }
 
@@ -888,6 +1168,304 @@ int relocate(void)
     return 0;
 }
 
+/*
+ * Parallel assembly (-t threads)
+ *
+ * The source is cut into parts at line boundaries, and the parts are
+ * parsed side by side, each with its own arena, names and relocations.
+ * Addresses in a part are offsets in segments whose bases are found
+ * afterwards by a prefix sum over the parts. The labels are then
+ * merged into one table in file order, and every part relocates its
+ * own code. Errors are reported as the serial assembler reports them:
+ * the first one in the file for parsing, the last for relocation.
+ */
+#define PART_BYTES (1 << 20)
+
+part_t *parts = NULL;
+int nparts = 0;
+int nthreads = 0;                    /* 0 to assemble in one go */
+static int next_part;                /* taken atomically by the workers */
+static void (*part_fn)(part_t *);
+static symbol_t **merged_symtab;     /* the labels of all the parts */
+static int merged_size;
+
+static void *part_worker(void *arg)
+{
+    int i;
+    while ((i = __sync_fetch_and_add(&next_part, 1)) < nparts)
+        part_fn(&parts[i]);
+    return NULL;
+}
+
+/* run fn on every part with nthreads threads */
+static void run_parts(void (*fn)(part_t *))
+{
+    int i, n = nthreads < nparts ? nthreads : nparts;
+    pthread_t *tids = (pthread_t *)malloc((n + 1) * sizeof(pthread_t));
+
+    part_fn = fn;
+    next_part = 0;
+    for (i = 0; i < n; i++)
+        if (pthread_create(&tids[i], NULL, part_worker, NULL)) {
+            err_print("Can't create worker thread %d", i);
+            exit(1);
+        }
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+/* every part but the last ends with a newline, so that is its count */
+static void count_lines(part_t *p)
+{
+    char *c;
+    int n = 0;
+    for (c = p->begin; (c = memchr(c, '\n', p->end - c)); c++)
+        n++;
+    p->first_line = n; /* the count, until the prefix sum */
+}
+
+static void parse_part(part_t *p)
+{
+    line_t *line;
+    char *c, *next;
+
+    cur_part = p;
+    msg_out = open_memstream(&p->msg, &p->msg_len);
+    arena = NULL;
+    symtab = NULL;
+    symtab_size = symtab_count = 0;
+    reltab = (reloc_t *)arena_alloc(sizeof(reloc_t));
+    vmaddr = 0;
+    maxDest = 0;
+    maxDestLineNo = 0;
+    lineno = p->first_line;
+    start_segment(NULL, TRUE, 0);
+
+    for (c = p->begin; c < p->end; c = next) {
+        next = cut_line(c, p->end);
+
+        line = (line_t *)arena_alloc(sizeof(line_t));
+        line->type = TYPE_COMM;
+        line->y64asm = c;
+        if (p->line_tail)
+            p->line_tail->next = line;
+        else
+            p->line_head = line;
+        p->line_tail = line;
+        lineno ++;
+
+        if (parse_line(line) == TYPE_ERR) {
+            p->err_line = lineno;
+            break;
+        }
+    }
+
+    p->size = vmaddr;
+    p->maxDest = maxDest;
+    p->maxDestLineNo = maxDestLineNo;
+    p->symtab = symtab;
+    p->symtab_size = symtab_size;
+    p->symtab_count = symtab_count;
+    p->reltab = reltab;
+    p->arena = arena;
+    fclose(msg_out);
+    msg_out = NULL;
+    cur_part = NULL;
+    arena = NULL;
+    symtab = NULL;
+    symtab_size = symtab_count = 0;
+}
+
+/* add the segment bases to the addresses of lines and labels */
+static void place_part(part_t *p)
+{
+    line_t *line;
+    int k = 0, i;
+
+    for (line = p->line_head; line; line = line->next) {
+        while (k + 1 < p->nsegs && p->segs[k + 1].first == line)
+            k++;
+        if (line->type == TYPE_INS)
+            line->y64bin.addr += p->segs[k].base;
+    }
+    for (i = 0; i < p->nlabels; i++)
+        p->labels[i].sym->addr += p->segs[p->labels[i].seg].base;
+}
+
+/*
+ * assemble_parallel: assemble() with the work shared by nthreads threads
+ *
+ * return
+ *     0: success
+ *     -1: error, the same one assemble() would report
+ */
+int assemble_parallel(FILE *in)
+{
+    size_t len = read_source(in);
+    char *c, *cut, *end = src_buf + len;
+    int64_t addr = 0;
+    symbol_t **slot, *sym;
+    segment_t *seg;
+    part_t *p;
+    int i, j, n;
+
+    /* cut the source into parts of about PART_BYTES whole lines */
+    parts = (part_t *)calloc(len / PART_BYTES + 1, sizeof(part_t));
+    for (c = src_buf; c < end; c = cut) {
+        cut = end - c > PART_BYTES ? memchr(c + PART_BYTES, '\n',
+                                            end - c - PART_BYTES) : NULL;
+        cut = cut ? cut + 1 : end;
+        parts[nparts].begin = c;
+        parts[nparts++].end = cut;
+    }
+    run_parts(count_lines);
+    for (i = n = 0; i < nparts; i++) {
+        j = parts[i].first_line;
+        parts[i].first_line = n;
+        n += j;
+    }
+
+    run_parts(parse_part);
+
+    /* merge the labels, stopping at the first error in the file */
+    for (i = 0; i < nparts; i++) {
+        p = &parts[i];
+        for (j = 0; j < p->nlabels; j++) {
+            sym = p->labels[j].sym;
+            if (2 * (symtab_count + 1) > symtab_size)
+                grow_symtab();
+            slot = probe_symtab(symtab, symtab_size, sym->name, sym->len,
+                                sym->hash);
+            if (*slot) {
+                lineno = p->labels[j].lineno;
+                err_print("Dup symbol:%s", sym->name);
+                return -1;
+            }
+            *slot = sym;
+            symtab_count++;
+        }
+        if (p->err_line) {
+            fwrite(p->msg, 1, p->msg_len, stderr);
+            lineno = p->err_line;
+            return -1;
+        }
+    }
+    merged_symtab = symtab;
+    merged_size = symtab_size;
+
+    /* prefix sum of the segment bases */
+    for (i = 0; i < nparts; i++) {
+        p = &parts[i];
+        for (j = 0; j < p->nsegs; j++) {
+            seg = &p->segs[j];
+            if (!seg->relative)
+                seg->base = 0;
+            else if (!seg->align)
+                seg->base = addr;
+            else {
+                int64_t a = p->segs[j - 1].base + seg->start;
+                seg->base = a % seg->align == 0 ? a :
+                    ((int64_t)(a / seg->align) + 1) * seg->align;
+            }
+        }
+        addr = p->segs[p->nsegs - 1].base + p->size;
+        if (p->maxDest > maxDest) {
+            maxDest = p->maxDest;
+            maxDestLineNo = p->maxDestLineNo;
+        }
+    }
+    vmaddr = addr;
+
+    if(maxDest > vmaddr)
+    {
+        lineno = maxDestLineNo;
+        err_print("Invalid DEST");
+        return -1;
+    }
+
+    run_parts(place_part);
+    for (i = 0; i < nparts; i++) {
+        if (!parts[i].line_head)
+            continue;
+        line_tail->next = parts[i].line_head;
+        line_tail = parts[i].line_tail;
+    }
+
+    lineno = -1;
+    return 0;
+}
+
+/* resolve the names the part uses from the merged labels, and relocate */
+static void relocate_part(part_t *p)
+{
+    symbol_t *sym, *def;
+    int i;
+
+    for (i = 0; merged_size && i < p->symtab_size; i++) {
+        sym = p->symtab[i];
+        if (!sym || sym->defined)
+            continue;
+        def = *probe_symtab(merged_symtab, merged_size, sym->name, sym->len,
+                            sym->hash);
+        if (def) {
+            sym->defined = TRUE;
+            sym->addr = def->addr;
+        }
+    }
+
+    free(p->msg);
+    msg_out = open_memstream(&p->msg, &p->msg_len);
+    reltab = p->reltab;
+    lineno = 0;
+    p->reloc_err = relocate() < 0;
+    fclose(msg_out);
+    msg_out = NULL;
+}
+
+/*
+ * relocate_parallel: relocate() for the parts of assemble_parallel()
+ *
+ * return
+ *     0: success
+ *     -1: error, the same one relocate() would report
+ */
+int relocate_parallel(void)
+{
+    int i;
+
+    run_parts(relocate_part);
+    for (i = nparts - 1; i >= 0; i--)
+        if (parts[i].reloc_err) {
+            fwrite(parts[i].msg, 1, parts[i].msg_len, stderr);
+            return -1;
+        }
+    return 0;
+}
+
+/*
+ * skip_gap: move the output 'len' zero bytes ahead, as a hole in the
+ *     file if it can seek, else by writing zero pages
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+static int skip_gap(FILE *out, int64_t len)
+{
+    static const byte_t zero_page[4096];
+
+    if (fseeko(out, len, SEEK_CUR) == 0)
+        return 0;
+    while (len > 0) {
+        size_t n = len < (int64_t)sizeof(zero_page) ? len : sizeof(zero_page);
+        if (fwrite(zero_page, 1, n, out) != n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
 /*
  * binfile: generate the y64 binary file
  * args
@@ -899,31 +1477,45 @@ int relocate(void)
  */
 int binfile(FILE *out)
 {
-    /* prepare image with y64 binary code */
     line_t *curLine = line_head->next;
-    long curByte = 0;
-    char zeroByte = 0;
-    /* binary write y64 code to output file (NOTE: see fwrite()) */
-    while(curLine)
+    int64_t pos = 0;    /* where the current extent starts */
+    byte_t *ext = NULL; /* code of the current extent */
+    size_t len = 0, max = 0;
+    int64_t addr;
+    int ret = 0;
+
+    /* 
+     * coalesce the code into extents of contiguous bytes, write each
+     * with one fwrite() and skip the gap before it; code whose address
+     * is below the end of the image is appended, as it always was
+     */
+    for (; curLine && ret == 0; curLine = curLine->next)
     {
-        if((curLine->y64bin).bytes != 0)
+        bin_t *bin = &curLine->y64bin;
+        if (bin->bytes == 0)
+            continue;
+        addr = bin->addr;
+        if (addr > pos + (int64_t)len)
         {
-            // fill 0 until addr
-            while(curByte < (curLine->y64bin).addr)
-            {
-                
-                if(fwrite(&zeroByte, 1, 1, out) != 1)
-                    return -1;
-                curByte++;
-            }
-            long bytesToWrite = (curLine->y64bin).bytes;
-            if(fwrite((curLine->y64bin).codes, 1, bytesToWrite, out) != bytesToWrite)
-                return -1;
-            curByte += bytesToWrite;
+            if (len && fwrite(ext, 1, len, out) != len)
+                ret = -1;
+            else if (skip_gap(out, addr - pos - len) < 0)
+                ret = -1;
+            pos = addr;
+            len = 0;
+        }
+        if (len + bin->bytes > max)
+        {
+            max = max ? 2 * max : 4096;
+            ext = (byte_t *)realloc(ext, max);
         }
-        curLine = curLine->next;
+        memcpy(ext + len, bin->codes, bin->bytes);
+        len += bin->bytes;
     }
-    return 0;
+    if (ret == 0 && len && fwrite(ext, 1, len, out) != len)
+        ret = -1;
+    free(ext);
+    return ret;
 }
 
 
@@ -979,52 +1571,42 @@ void print_screen(void)
 /* init and finit */
 void init(void)
 {
-    reltab = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
-    memset(reltab, 0, sizeof(reloc_t));
-
-    symtab = (symbol_t *)malloc(sizeof(symbol_t)); // free in finit
-    memset(symtab, 0, sizeof(symbol_t));
-
-    line_head = (line_t *)malloc(sizeof(line_t)); // free in finit
-    memset(line_head, 0, sizeof(line_t));
+    reltab = (reloc_t *)arena_alloc(sizeof(reloc_t));
+    line_head = (line_t *)arena_alloc(sizeof(line_t));
     line_tail = line_head;
     lineno = 0;
 }
 
 void finit(void)
 {
-    reloc_t *rtmp = NULL;
-    do {
-        rtmp = reltab->next;
-        if (reltab->name) 
-            free(reltab->name);
-        free(reltab);
-        reltab = rtmp;
-    } while (reltab);
-    
-    symbol_t *stmp = NULL;
-    do {
-        stmp = symtab->next;
-        if (symtab->name) 
-            free(symtab->name);
-        free(symtab);
-        symtab = stmp;
-    } while (symtab);
-
-    line_t *ltmp = NULL;
-    do {
-        ltmp = line_head->next;
-        if (line_head->y64asm) 
-            free(line_head->y64asm);
-        free(line_head);
-        line_head = ltmp;
-    } while (line_head);
+    int i;
+
+    free(symtab);
+    symtab = NULL;
+    symtab_size = symtab_count = 0;
+    free(src_buf);
+    src_buf = NULL;
+    arena_free();
+    for (i = 0; i < nparts; i++) {
+        arena = parts[i].arena;
+        arena_free();
+        free(parts[i].symtab);
+        free(parts[i].segs);
+        free(parts[i].labels);
+        free(parts[i].msg);
+    }
+    free(parts);
+    parts = NULL;
+    nparts = 0;
+    reltab = NULL;
+    line_head = line_tail = NULL;
 }
 
 static void usage(char *pname)
 {
-    printf("Usage: %s [-v] file.ys\n", pname);
+    printf("Usage: %s [-v] [-t threads] file.ys\n", pname);
     printf("   -v print the readable output to screen\n");
+    printf("   -t assemble in parallel with that many threads\n");
     exit(0);
 }
 
@@ -1039,17 +1621,24 @@ int main(int argc, char *argv[])
     if (argc < 2)
         usage(argv[0]);
     
-    if (argv[nextarg][0] == '-') {
+    while (nextarg < argc && argv[nextarg][0] == '-') {
         char flag = argv[nextarg][1];
         switch (flag) {
           case 'v':
             screen = TRUE;
             nextarg++;
             break;
+          case 't':
+            if (nextarg + 1 >= argc || (nthreads = atoi(argv[nextarg+1])) < 1)
+                usage(argv[0]);
+            nextarg += 2;
+            break;
           default:
             usage(argv[0]);
         }
     }
+    if (nextarg >= argc)
+        usage(argv[0]);
 
     /* parse input file name */
     rootlen = strlen(argv[nextarg])-3;
@@ -1076,7 +1665,7 @@ int main(int argc, char *argv[])
         exit(1);
     }
     
-    if (assemble(in) < 0) {
+    if ((nthreads ? assemble_parallel(in) : assemble(in)) < 0) {
         err_print("Assemble y64 code error");
         fclose(in);
         exit(1);
@@ -1085,7 +1674,7 @@ int main(int argc, char *argv[])
 
 
     /* relocate binary code */
-    if (relocate() < 0) {
+    if ((nthreads ? relocate_parallel() : relocate()) < 0) {
         err_print("Relocate binary code error");
         exit(1);
     }
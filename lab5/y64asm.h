@@ -72,19 +72,69 @@ typedef struct line {
     struct line *next;
 } line_t;
 
-/* label defined in y64 assembly code, e.g. Loop */
+/* label defined or referenced in y64 assembly code, e.g. Loop */
 typedef struct symbol {
     char *name;
+    int len;
+    unsigned int hash;
+    bool_t defined; /* FALSE while only referenced */
     int64_t addr;
-    struct symbol *next;
 } symbol_t;
 
 /* binary code need to be relocated */
 typedef struct reloc {
     bin_t *y64bin;
-    char *name;
+    symbol_t *sym;
     struct reloc *next;
 } reloc_t;
 
+/* bump allocator, everything in it is released at once */
+typedef struct chunk {
+    struct chunk *next;
+    size_t size, used;
+    char data[];
+} chunk_t;
+
+/* 
+ * run of lines in a part whose addresses are offsets from one base:
+ * the start of the part, a .pos, or an .align reached at an offset
+ */
+typedef struct segment {
+    line_t *first;   /* first line of the segment */
+    bool_t relative; /* FALSE after .pos, where addresses are absolute */
+    int64_t align;   /* .align that starts it, 0 if none */
+    int64_t start;   /* offset in the previous segment where it starts */
+    int64_t base;    /* absolute address of offset 0 */
+} segment_t;
+
+/* label defined in a part */
+typedef struct label {
+    symbol_t *sym;
+    int seg;
+    int lineno;
+} label_t;
+
+/* part of the source assembled by one thread (-t) */
+typedef struct part {
+    char *begin, *end;         /* the source text */
+    int first_line;            /* line number before its first line */
+    line_t *line_head, *line_tail;
+    segment_t *segs;
+    int nsegs, maxsegs;
+    label_t *labels;
+    int nlabels, maxlabels;
+    int64_t size;              /* offset at the end of the last segment */
+    int64_t maxDest;
+    int maxDestLineNo;
+    int err_line;              /* line of the first error, 0 if none */
+    int reloc_err;             /* relocate() failed */
+    symbol_t **symtab;         /* names seen in the part */
+    int symtab_size, symtab_count;
+    reloc_t *reltab;
+    chunk_t *arena;
+    char *msg;                 /* error messages */
+    size_t msg_len;
+} part_t;
+
 #endif
 
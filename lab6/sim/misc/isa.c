@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "isa.h"
 
 
@@ -36,13 +37,30 @@ struct {
 };
 
 
+/* Switch over the letters of the name, then compare one candidate */
 reg_id_t find_register(char *name)
 {
-    int i;
-    for (i = 0; i < REG_NONE; i++)
-	if (!strcmp(name, reg_table[i].name))
-	    return reg_table[i].id;
-    return REG_ERR;
+    reg_id_t id;
+
+    if (name[0] != '%' || name[1] != 'r')
+	return REG_ERR;
+    switch (name[2]) {
+    case 'a': id = REG_RAX; break;
+    case 'c': id = REG_RCX; break;
+    case 'd': id = name[3] == 'x' ? REG_RDX : REG_RDI; break;
+    case 'b': id = name[3] == 'x' ? REG_RBX : REG_RBP; break;
+    case 's': id = name[3] == 'p' ? REG_RSP : REG_RSI; break;
+    case '8': id = REG_R8; break;
+    case '9': id = REG_R9; break;
+    case '1':
+	if (name[3] < '0' || name[3] > '4')
+	    return REG_ERR;
+	id = REG_R10 + (name[3] - '0');
+	break;
+    default:
+	return REG_ERR;
+    }
+    return strcmp(name, reg_table[id].name) ? REG_ERR : id;
 }
 
 char *reg_name(reg_id_t id)
@@ -59,6 +77,13 @@ int reg_valid(reg_id_t id)
   return id >= 0 && id < REG_NONE && reg_table[id].id == id;
 }
 
+/* Positions in instruction_set: cmovXX and jXX follow cond_t,
+   OPq follows alu_t */
+enum { IX_NOP, IX_HALT, IX_RRMOVQ, IX_IRMOVQ = IX_RRMOVQ + C_G + 1,
+       IX_RMMOVQ, IX_MRMOVQ, IX_ALU, IX_JMP = IX_ALU + A_NONE,
+       IX_CALL = IX_JMP + C_G + 1, IX_RET, IX_PUSHQ, IX_POPQ, IX_IADDQ,
+       IX_POP2, IX_BYTE, IX_WORD, IX_LONG, IX_QUAD };
+
 instr_t instruction_set[] = 
 {
     {"nop",    HPACK(I_NOP, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
@@ -106,13 +131,77 @@ instr_t instruction_set[] =
 instr_t invalid_instr =
     {"XXX",     0   , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 };
 
+/* Condition that ends a cmovXX or jXX, C_YES if none */
+static cond_t find_cond(char *s)
+{
+    switch (s[0]) {
+    case 'l': return s[1] == 'e' ? C_LE : C_L;
+    case 'e': return C_E;
+    case 'n': return s[1] == 'e' ? C_NE : C_YES;
+    case 'g': return s[1] == 'e' ? C_GE : C_G;
+    default:  return C_YES;
+    }
+}
+
+/* Switch over the letters of the name, then compare one candidate */
 instr_ptr find_instr(char *name)
 {
+    cond_t cond;
     int i;
-    for (i = 0; instruction_set[i].name; i++)
-	if (strcmp(instruction_set[i].name,name) == 0)
-	    return &instruction_set[i];
-    return NULL;
+
+    switch (name[0]) {
+    case 'n': i = IX_NOP; break;
+    case 'h': i = IX_HALT; break;
+    case 'm': i = IX_MRMOVQ; break;
+    case 'a': i = name[1] == 'n' ? IX_ALU + A_AND : IX_ALU + A_ADD; break;
+    case 's': i = IX_ALU + A_SUB; break;
+    case 'x': i = IX_ALU + A_XOR; break;
+    case 'i': i = name[1] == 'a' ? IX_IADDQ : IX_IRMOVQ; break;
+    case 'r':
+	if (name[1] == 'r')
+	    i = IX_RRMOVQ;
+	else
+	    i = name[1] == 'm' ? IX_RMMOVQ : IX_RET;
+	break;
+    case 'c':
+	if (name[1] == 'a') {
+	    i = IX_CALL;
+	    break;
+	}
+	if (strncmp(name, "cmov", 4) || (cond = find_cond(name + 4)) == C_YES)
+	    return NULL;
+	i = IX_RRMOVQ + cond;
+	break;
+    case 'j':
+	if (name[1] == 'm') {
+	    i = IX_JMP;
+	    break;
+	}
+	if ((cond = find_cond(name + 1)) == C_YES)
+	    return NULL;
+	i = IX_JMP + cond;
+	break;
+    case 'p':
+	if (name[1] == 'u')
+	    i = IX_PUSHQ;
+	else
+	    i = name[1] && name[2] && name[3] == '2' ? IX_POP2 : IX_POPQ;
+	break;
+    case '.':
+	switch (name[1]) {
+	case 'b': i = IX_BYTE; break;
+	case 'w': i = IX_WORD; break;
+	case 'l': i = IX_LONG; break;
+	case 'q': i = IX_QUAD; break;
+	default:  return NULL;
+	}
+	break;
+    default:
+	return NULL;
+    }
+    if (strcmp(instruction_set[i].name, name))
+	return NULL;
+    return &instruction_set[i];
 }
 
 /* Return name of instruction given its encoding */
@@ -180,14 +269,62 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
     return diff;
 }
 
-int hex2dig(char c)
+/* Value plus one of each hex digit, 0 for any other character */
+static const byte_t hex_tab[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+#define IS_HEX(c) (hex_tab[(byte_t) (c)] != 0)
+#define HEX_VAL(c) (hex_tab[(byte_t) (c)] - 1)
+
+/* Read all of infile with one read where it can.  Sets *lenp */
+static char *read_file(FILE *infile, size_t *lenp)
 {
-    if (isdigit((int)c))
-	return c - '0';
-    if (isupper((int)c))
-	return c - 'A' + 10;
-    else
-	return c - 'a' + 10;
+    struct stat st;
+    size_t size, len = 0, n;
+    char *buf;
+
+    size = fstat(fileno(infile), &st) == 0 && st.st_size > 0 ?
+	st.st_size : 4096;
+    buf = (char *) malloc(size + 1);
+    while ((n = fread(buf + len, 1, size - len, infile)) > 0) {
+	len += n;
+	if (len == size) {
+	    size *= 2;
+	    buf = (char *) realloc(buf, size + 1);
+	}
+    }
+    buf[len] = '\0';
+    *lenp = len;
+    return buf;
+}
+
+/* Is fname a .bin image rather than a .yo file? */
+int is_bin_file(char *fname)
+{
+    size_t len = fname ? strlen(fname) : 0;
+    return len > 4 && strcmp(fname + len - 4, ".bin") == 0;
+}
+
+/* Load a .bin image as y64asm writes it, which starts at address 0 */
+int load_bin(mem_t m, FILE *infile, int report_error)
+{
+    size_t len;
+    char *image = read_file(infile, &len);
+
+    if (len > m->len) {
+	if (report_error)
+	    fprintf(stderr,
+		    "Error reading file. Image of 0x%lx bytes is larger "
+		    "than memory\n", (unsigned long) len);
+	free(image);
+	return 0;
+    }
+    memcpy(m->contents, image, len);
+    free(image);
+    return len;
 }
 
 #define LINELEN 4096
@@ -199,6 +336,8 @@ int load_mem(mem_t m, FILE *infile, int report_error)
     int byte_cnt = 0;
     int lineno = 0;
     word_t bytepos = 0;
+    size_t len, pos = 0, n;
+    char *text = read_file(infile, &len), *nl;
 #ifdef HAS_GUI
     int empty_line = 1;
     int addr = 0;
@@ -208,8 +347,17 @@ int load_mem(mem_t m, FILE *infile, int report_error)
     char line[LINELEN];
     int index = 0;
 #endif /* HAS_GUI */   
-    while (fgets(buf, LINELEN, infile)) {
+
+    /* Cut lines as fgets would */
+    while (pos < len) {
 	int cpos = 0;
+	nl = memchr(text + pos, '\n', len - pos);
+	n = nl ? nl - (text + pos) + 1 : len - pos;
+	if (n > LINELEN - 1)
+	    n = LINELEN - 1;
+	memcpy(buf, text + pos, n);
+	buf[n] = '\0';
+	pos += n;
 #ifdef HAS_GUI
 	empty_line = 1;
 #endif
@@ -225,9 +373,9 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 
 	/* Get address */
 	bytepos = 0;
-	while (isxdigit((int)(c=buf[cpos]))) {
+	while (IS_HEX(c=buf[cpos])) {
 	    cpos++;
-	    bytepos = bytepos*16 + hex2dig(c);
+	    bytepos = bytepos*16 + HEX_VAL(c);
 	}
 
 	while (isspace((int)buf[cpos]))
@@ -240,6 +388,7 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 		fprintf(stderr,
 			"Reading '%c' at position %d\n", buf[cpos], cpos);
 	    }
+	    free(text);
 	    return 0;
 	}
 
@@ -252,8 +401,7 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	    cpos++;
 
 	/* Get code */
-	while (isxdigit((int)(ch=buf[cpos++])) && 
-	       isxdigit((int)(cl=buf[cpos++]))) {
+	while (IS_HEX(ch=buf[cpos++]) && IS_HEX(cl=buf[cpos++])) {
 	    byte_t byte = 0;
 	    if (bytepos >= m->len) {
 		if (report_error) {
@@ -262,9 +410,10 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 			    bytepos);
 		    fprintf(stderr, "Line %d:%s\n", lineno, buf);
 		}
+		free(text);
 		return 0;
 	    }
-	    byte = hex2dig(ch)*16+hex2dig(cl);
+	    byte = HEX_VAL(ch)*16+HEX_VAL(cl);
 	    m->contents[bytepos++] = byte;
 	    byte_cnt++;
 #ifdef HAS_GUI
@@ -296,6 +445,7 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	}
 #endif /* HAS_GUI */ 
     }
+    free(text);
     return byte_cnt;
 }
 
@@ -544,6 +694,7 @@ state_ptr new_state(int memlen)
     result->r = init_reg();
     result->m = init_mem(memlen);
     result->cc = DEFAULT_CC;
+    result->cc_op = A_NONE;
     return result;
 }
 
@@ -559,7 +710,8 @@ state_ptr copy_state(state_ptr s) {
     result->pc = s->pc;
     result->r = copy_reg(s->r);
     result->m = copy_mem(s->m);
-    result->cc = s->cc;
+    result->cc = state_cc(s);
+    result->cc_op = A_NONE;
     return result;
 }
 
@@ -572,7 +724,7 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
 	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", olds->pc, news->pc);
 	}
     }
-    if (olds->cc != news->cc) {
+    if (state_cc(olds) != state_cc(news)) {
 	diff = TRUE;
 	if (outfile) {
 	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(olds->cc), cc_name(news->cc));
@@ -586,6 +738,15 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
 }
 
 
+cc_t state_cc(state_ptr s)
+{
+    if (s->cc_op != A_NONE) {
+	s->cc = compute_cc(s->cc_op, s->cc_a, s->cc_b);
+	s->cc_op = A_NONE;
+    }
+    return s->cc;
+}
+
 /* Branch logic */
 bool_t cond_holds(cc_t cc, cond_t bcond) {
     bool_t zf = GET_ZF(cc);
@@ -702,7 +863,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	    return STAT_INS;
 	}
 	val = get_reg_val(s->r, hi1);
-	if (cond_holds(s->cc, lo0))
+	if ((cond_t) lo0 == C_YES || cond_holds(state_cc(s), lo0))
 	  set_reg_val(s->r, lo1, val);
 	s->pc = ftpc;
 	break;
@@ -800,7 +961,15 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(lo0, argA, argB);
+	/* Flags are left for state_cc(); A_NONE and above are not ops */
+	if (lo0 <= A_XOR) {
+	    s->cc_op = lo0;
+	    s->cc_a = argA;
+	    s->cc_b = argB;
+	} else {
+	    s->cc = compute_cc(lo0, argA, argB);
+	    s->cc_op = A_NONE;
+	}
 	s->pc = ftpc;
 	break;
     case I_JMP:
@@ -816,7 +985,7 @@ stat_t step_state(state_ptr s, FILE *error_file)
 			"PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
-	if (cond_holds(s->cc, lo0))
+	if ((cond_t) lo0 == C_YES || cond_holds(state_cc(s), lo0))
 	    s->pc = cval;
 	else
 	    s->pc = ftpc;
@@ -930,7 +1099,9 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(A_ADD, cval, argB);
+	s->cc_op = A_ADD;
+	s->cc_a = cval;
+	s->cc_b = argB;
 	s->pc = ftpc;
 	break;
     default:
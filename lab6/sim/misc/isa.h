@@ -119,6 +119,12 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 /* Load memory from .yo file.  Return number of bytes read */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/* Load memory from .bin image.  Return number of bytes read */
+int load_bin(mem_t m, FILE *infile, int report_error);
+
+/* Does the file name end in .bin? */
+int is_bin_file(char *fname);
+
 /* Get byte from memory */
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest);
 
@@ -182,11 +188,16 @@ char *stat_name(stat_t e);
 
 /* **************** ISA level implementation *********/
 
+/* Condition codes are evaluated lazily: an ALU operation only records
+   its function and operands, and state_cc() computes cc from them when
+   it is needed.  Code that assigns cc directly must reset cc_op. */
 typedef struct {
   word_t pc;
   mem_t r;
   mem_t m;
   cc_t cc;
+  alu_t cc_op;          /* A_NONE if cc is current */
+  word_t cc_a, cc_b;    /* compute_cc() arguments of cc_op */
 } state_rec, *state_ptr;
 
 state_ptr new_state(int memlen);
@@ -195,6 +206,9 @@ void free_state(state_ptr s);
 state_ptr copy_state(state_ptr s);
 bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile);
 
+/* Current condition codes of the state */
+cc_t state_cc(state_ptr s);
+
 /* Determine if condition satisified */
 bool_t cond_holds(cc_t cc, cond_t bcond);
 
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "isa.h"
 
@@ -10,14 +11,312 @@ int gui_mode = 0;
 
 void usage(char *pname)
 {
-    printf("Usage: %s code_file [max_steps]\n", pname);
+    printf("Usage: %s [-p prefix] code_file [max_steps]\n", pname);
+    printf("   -p prefix  Profile the run into prefix.prof and prefix.folded\n");
     exit(0);
 }
 
+/*
+ * Profiler (-p prefix).  Around each step_state() it counts executions
+ * per PC, taken and not taken conditional jumps, loads and stores per
+ * address, and charges every instruction to the call stack it ran in.
+ * Call enters the function at its target and ret leaves it; a function
+ * calling itself stays in the same frame.  prefix.prof gets a flat
+ * profile, the call graph and the memory accesses, prefix.folded one
+ * "f1;f2;...;fn count" line per stack for flame graph tools.
+ */
+
+typedef struct frame {
+    word_t func;		/* Entry address */
+    word_t self;		/* Instructions run in this stack */
+    word_t calls;		/* Times entered from the parent */
+    word_t rec_calls;		/* Times it called itself */
+    struct frame *parent, *child, *sibling;
+} frame_rec, *frame_ptr;
+
+typedef struct {
+    int len;
+    word_t total;
+    word_t *count;		/* Executions per PC */
+    word_t *taken, *not_taken;	/* Outcomes of jXX per PC */
+    word_t *loads, *stores;	/* Accesses per address */
+    frame_ptr root, cur;
+    frame_ptr *stack;		/* Frames to return to */
+    int depth, max_depth;
+} prof_rec, *prof_ptr;
+
+static frame_ptr new_frame(frame_ptr parent, word_t func)
+{
+    frame_ptr f = (frame_ptr) calloc(1, sizeof(frame_rec));
+    f->func = func;
+    f->parent = parent;
+    if (parent) {
+	f->sibling = parent->child;
+	parent->child = f;
+    }
+    return f;
+}
+
+static void free_frames(frame_ptr f)
+{
+    frame_ptr next;
+    for (; f; f = next) {
+	next = f->sibling;
+	free_frames(f->child);
+	free(f);
+    }
+}
+
+static prof_ptr new_prof(state_ptr s)
+{
+    prof_ptr p = (prof_ptr) calloc(1, sizeof(prof_rec));
+    p->len = s->m->len;
+    p->count = (word_t *) calloc(p->len, sizeof(word_t));
+    p->taken = (word_t *) calloc(p->len, sizeof(word_t));
+    p->not_taken = (word_t *) calloc(p->len, sizeof(word_t));
+    p->loads = (word_t *) calloc(p->len, sizeof(word_t));
+    p->stores = (word_t *) calloc(p->len, sizeof(word_t));
+    p->root = p->cur = new_frame(NULL, s->pc);
+    return p;
+}
+
+static void free_prof(prof_ptr p)
+{
+    free(p->count);
+    free(p->taken);
+    free(p->not_taken);
+    free(p->loads);
+    free(p->stores);
+    free_frames(p->root);
+    free(p->stack);
+    free(p);
+}
+
+/* step_state() with the bookkeeping around it */
+static stat_t prof_step(prof_ptr p, state_ptr s, FILE *error_file)
+{
+    word_t pc = s->pc, addr = -1, imm = 0;
+    byte_t byte0 = 0, byte1 = 0;
+    bool_t store = FALSE, taken = FALSE;
+    int icode, ifun;
+    frame_ptr f;
+    stat_t e;
+
+    get_byte_val(s->m, pc, &byte0);
+    icode = HI4(byte0);
+    ifun = LO4(byte0);
+    switch (icode) {
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	get_byte_val(s->m, pc + 1, &byte1);
+	get_word_val(s->m, pc + 2, &imm);
+	addr = imm + get_reg_val(s->r, (reg_id_t) LO4(byte1));
+	store = icode == I_RMMOVQ;
+	break;
+    case I_PUSHQ:
+    case I_CALL:
+	addr = get_reg_val(s->r, REG_RSP) - 8;
+	store = TRUE;
+	break;
+    case I_POPQ:
+    case I_RET:
+	addr = get_reg_val(s->r, REG_RSP);
+	break;
+    case I_JMP:
+	taken = ifun != C_YES && cond_holds(state_cc(s), (cond_t) ifun);
+	break;
+    }
+
+    e = step_state(s, error_file);
+
+    p->total++;
+    p->cur->self++;
+    if (pc < 0 || pc >= p->len)
+	return e;
+    p->count[pc]++;
+    if (e != STAT_AOK)
+	return e;
+
+    if (addr >= 0 && addr < p->len) {
+	if (store)
+	    p->stores[addr]++;
+	else
+	    p->loads[addr]++;
+    }
+    if (icode == I_JMP && ifun != C_YES) {
+	if (taken)
+	    p->taken[pc]++;
+	else
+	    p->not_taken[pc]++;
+    } else if (icode == I_CALL) {
+	if (p->depth == p->max_depth) {
+	    p->max_depth = p->max_depth ? 2 * p->max_depth : 64;
+	    p->stack = (frame_ptr *)
+		realloc(p->stack, p->max_depth * sizeof(frame_ptr));
+	}
+	p->stack[p->depth++] = p->cur;
+	if (p->cur->func == s->pc) {
+	    p->cur->rec_calls++;
+	} else {
+	    for (f = p->cur->child; f && f->func != s->pc; f = f->sibling)
+		;
+	    p->cur = f ? f : new_frame(p->cur, s->pc);
+	    p->cur->calls++;
+	}
+    } else if (icode == I_RET && p->depth > 0) {
+	p->cur = p->stack[--p->depth];
+    }
+    return e;
+}
+
+static prof_ptr sort_prof;
+
+static int cmp_count(const void *a, const void *b)
+{
+    word_t ca = sort_prof->count[*(const int *) a];
+    word_t cb = sort_prof->count[*(const int *) b];
+    if (ca != cb)
+	return ca < cb ? 1 : -1;
+    return *(const int *) a - *(const int *) b;
+}
+
+/* A call graph edge */
+typedef struct {
+    word_t caller, callee, calls;
+} edge_rec;
+
+static int cmp_edge(const void *a, const void *b)
+{
+    const edge_rec *x = (const edge_rec *) a, *y = (const edge_rec *) b;
+    if (x->caller != y->caller)
+	return x->caller < y->caller ? -1 : 1;
+    if (x->callee != y->callee)
+	return x->callee < y->callee ? -1 : 1;
+    return 0;
+}
+
+static void add_edge(edge_rec **edges, int *n, int *max,
+		     word_t caller, word_t callee, word_t calls)
+{
+    if (*n == *max) {
+	*max = *max ? 2 * *max : 16;
+	*edges = (edge_rec *) realloc(*edges, *max * sizeof(edge_rec));
+    }
+    (*edges)[*n].caller = caller;
+    (*edges)[*n].callee = callee;
+    (*edges)[(*n)++].calls = calls;
+}
+
+static void collect_edges(frame_ptr f, edge_rec **edges, int *n, int *max)
+{
+    for (; f; f = f->sibling) {
+	if (f->parent)
+	    add_edge(edges, n, max, f->parent->func, f->func, f->calls);
+	if (f->rec_calls)
+	    add_edge(edges, n, max, f->func, f->func, f->rec_calls);
+	collect_edges(f->child, edges, n, max);
+    }
+}
+
+/* Print the stack of f as "f1;f2;...;fn" */
+static void print_stack(FILE *out, frame_ptr f)
+{
+    if (f->parent) {
+	print_stack(out, f->parent);
+	fputc(';', out);
+    }
+    fprintf(out, "0x%llx", f->func);
+}
+
+static void write_folded(FILE *out, frame_ptr f)
+{
+    for (; f; f = f->sibling) {
+	if (f->self) {
+	    print_stack(out, f);
+	    fprintf(out, " %lld\n", f->self);
+	}
+	write_folded(out, f->child);
+    }
+}
+
+/* Write prefix.prof and prefix.folded.  Return 0 on failure */
+static int write_prof(prof_ptr p, state_ptr s, char *prefix)
+{
+    char fname[1024];
+    edge_rec *edges = NULL;
+    int *pcs, n_pcs = 0, n = 0, max = 0, i, j;
+    word_t pc, cumul = 0;
+    byte_t byte0 = 0;
+    FILE *out;
+
+    snprintf(fname, sizeof(fname), "%s.prof", prefix);
+    if (!(out = fopen(fname, "w"))) {
+	fprintf(stderr, "Can't write profile '%s'\n", fname);
+	return 0;
+    }
+
+    pcs = (int *) malloc(p->len * sizeof(int));
+    for (i = 0; i < p->len; i++)
+	if (p->count[i])
+	    pcs[n_pcs++] = i;
+    sort_prof = p;
+    qsort(pcs, n_pcs, sizeof(int), cmp_count);
+    fprintf(out, "Flat profile: %lld instructions at %d addresses\n\n",
+	    p->total, n_pcs);
+    fprintf(out, "%12s %7s %7s  %-18s %-8s %12s %12s\n", "count", "%",
+	    "cumul%", "address", "insn", "taken", "not taken");
+    for (i = 0; i < n_pcs; i++) {
+	pc = pcs[i];
+	cumul += p->count[pc];
+	get_byte_val(s->m, pc, &byte0);
+	fprintf(out, "%12lld %7.2f %7.2f  0x%.16llx %-8s", p->count[pc],
+		100.0 * p->count[pc] / p->total,
+		100.0 * cumul / p->total, pc, iname(byte0));
+	if (p->taken[pc] || p->not_taken[pc])
+	    fprintf(out, " %12lld %12lld", p->taken[pc], p->not_taken[pc]);
+	fprintf(out, "\n");
+    }
+    free(pcs);
+
+    collect_edges(p->root, &edges, &n, &max);
+    qsort(edges, n, sizeof(edge_rec), cmp_edge);
+    fprintf(out, "\nCall graph: caller -> callee, calls\n\n");
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && !cmp_edge(edges + i, edges + j); j++)
+	    edges[i].calls += edges[j].calls;
+	fprintf(out, "0x%.16llx -> 0x%.16llx %12lld\n", edges[i].caller,
+		edges[i].callee, edges[i].calls);
+    }
+    free(edges);
+
+    for (i = n = 0; i < p->len; i++)
+	if (p->loads[i] || p->stores[i])
+	    n++;
+    fprintf(out, "\nMemory accessed: %d addresses\n\n", n);
+    fprintf(out, "%-18s %12s %12s\n", "address", "loads", "stores");
+    for (i = 0; i < p->len; i++)
+	if (p->loads[i] || p->stores[i])
+	    fprintf(out, "0x%.16llx %12lld %12lld\n", (word_t) i, p->loads[i],
+		    p->stores[i]);
+    fclose(out);
+
+    snprintf(fname, sizeof(fname), "%s.folded", prefix);
+    if (!(out = fopen(fname, "w"))) {
+	fprintf(stderr, "Can't write profile '%s'\n", fname);
+	return 0;
+    }
+    write_folded(out, p->root);
+    fclose(out);
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     FILE *code_file;
     int max_steps = 10000;
+    char *name = argv[0];
+    char *prof_prefix = NULL;
+    prof_ptr prof = NULL;
 
     state_ptr s = new_state(MEM_SIZE);
     mem_t saver = copy_reg(s->r);
@@ -26,15 +325,21 @@ int main(int argc, char *argv[])
 
     stat_t e = STAT_AOK;
 
+    if (argc > 2 && !strcmp(argv[1], "-p")) {
+	prof_prefix = argv[2];
+	argv += 2;
+	argc -= 2;
+    }
     if (argc < 2 || argc > 3)
-	usage(argv[0]);
+	usage(name);
     code_file = fopen(argv[1], "r");
     if (!code_file) {
 	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
 	exit(1);
     }
 
-    if (!load_mem(s->m, code_file, 1)) {
+    if (!(is_bin_file(argv[1]) ? load_bin(s->m, code_file, 1) :
+	  load_mem(s->m, code_file, 1))) {
 	printf("Exiting\n");
 	return 1;
     }
@@ -44,11 +349,19 @@ int main(int argc, char *argv[])
     if (argc > 2)
 	max_steps = atoi(argv[2]);
 
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-	e = step_state(s, stdout);
+    if (prof_prefix) {
+	prof = new_prof(s);
+	for (step = 0; step < max_steps && e == STAT_AOK; step++)
+	    e = prof_step(prof, s, stdout);
+	write_prof(prof, s, prof_prefix);
+	free_prof(prof);
+    } else {
+	for (step = 0; step < max_steps && e == STAT_AOK; step++)
+	    e = step_state(s, stdout);
+    }
 
     printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
-	   step, s->pc, stat_name(e), cc_name(s->cc));
+	   step, s->pc, stat_name(e), cc_name(state_cc(s)));
 
     printf("Changes to registers:\n");
     diff_reg(saver, s->r, stdout);
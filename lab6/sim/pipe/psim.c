@@ -201,7 +201,8 @@ static void run_tty_sim()
     if (verbosity >= 2)
 	printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = is_bin_file(object_filename) ?
+	load_bin(mem, object_file, 1) : load_mem(mem, object_file, 1);
     if (byte_cnt == 0) {
 	fprintf(stderr, "No lines of code found\n");
 	exit(1);
@@ -254,7 +255,7 @@ static void run_tty_sim()
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (state_cc(isa_state) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
@@ -282,8 +283,8 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
-    printf("file.yo arg required in GUI mode, optional in TTY mode (default stdin)\n");
+    printf("Usage: %s [-htg] [-l m] [-v n] file.yo|file.bin\n", name);
+    printf("file.yo or file.bin arg required in GUI mode, optional in TTY mode (default .yo on stdin)\n");
     printf("   -h     Print this message\n");
     printf("   -g     Run in GUI mode instead of TTY mode (default TTY)\n");  
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
@@ -649,6 +650,9 @@ static void update_state(bool_t update_mem, bool_t update_cc)
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
+  /* Naming every field is costly, so skip it when nothing is logged */
+  if (!dumpfile)
+    return;
   sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
 
   sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
@@ -879,7 +883,8 @@ int simLoadCodeCmd(ClientData clientData, Tcl_Interp *interp,
 	return TCL_ERROR;
     }
     sim_reset();
-    code_count = load_mem(mem, code_file, 0);
+    code_count = is_bin_file(argv[1]) ?
+	load_bin(mem, code_file, 0) : load_mem(mem, code_file, 0);
     post_load_mem = copy_mem(mem);
     sprintf(tcl_msg, "%lld", code_count);
     interp->result = tcl_msg;
@@ -1404,7 +1409,7 @@ void do_if_stage()
     }
     if_id_next->icode = gen_f_icode();
     if_id_next->ifun  = gen_f_ifun();
-    if (!imem_error) {
+    if (!imem_error && dumpfile) {
 	sim_log("\tFetch: f_pc = 0x%llx, imem_instr = %s, f_instr = %s\n",
 		f_pc, iname(instr),
 		iname(HPACK(if_id_next->icode, if_id_next->ifun)));
@@ -213,7 +213,8 @@ static void run_tty_sim()
     /* Emit simulator name */
     printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = is_bin_file(object_filename) ?
+	load_bin(mem, object_file, 1) : load_mem(mem, object_file, 1);
     if (byte_cnt == 0) {
 	fprintf(stderr, "No lines of code found\n");
 	exit(1);
@@ -267,7 +268,7 @@ static void run_tty_sim()
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (state_cc(isa_state) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
@@ -289,8 +290,8 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
-    printf("file.yo required in GUI mode, optional in TTY mode (default stdin)\n");
+    printf("Usage: %s [-htg] [-l m] [-v n] file.yo|file.bin\n", name);
+    printf("file.yo or file.bin required in GUI mode, optional in TTY mode (default .yo on stdin)\n");
     printf("   -h     Print this message\n");
     printf("   -g     Run in GUI mode instead of TTY mode (default TTY)\n");  
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
@@ -906,7 +907,8 @@ int simLoadCodeCmd(ClientData clientData, Tcl_Interp *interp,
 	return TCL_ERROR;
     }
     sim_reset();
-    code_count = load_mem(mem, object_file, 0);
+    code_count = is_bin_file(argv[1]) ?
+	load_bin(mem, object_file, 0) : load_mem(mem, object_file, 0);
     post_load_mem = copy_mem(mem);
     sprintf(tcl_msg, "%lld", code_count);
     interp->result = tcl_msg;
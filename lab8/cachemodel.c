@@ -0,0 +1,92 @@
+/*
+ * cachemodel.c - LRU cache model shared by the Cache Lab tools
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cachemodel.h"
+
+#define INVALID_TAG (~0ULL)
+
+/*
+ * cache_model_init - Allocate an empty cache
+ */
+void cache_model_init(cache_model_t *m, int s, int E, int b)
+{
+    size_t lines = ((size_t)1 << s) * E;
+    m->s = s;
+    m->E = E;
+    m->b = b;
+    m->tags = malloc(sizeof(unsigned long long) * lines);
+    m->stamps = malloc(sizeof(unsigned long long) * lines);
+    cache_model_reset(m);
+}
+
+/*
+ * cache_model_reset - Invalidate all lines and clear the statistics
+ */
+void cache_model_reset(cache_model_t *m)
+{
+    size_t lines = ((size_t)1 << m->s) * m->E;
+    memset(m->tags, 0xff, sizeof(unsigned long long) * lines);
+    memset(m->stamps, 0, sizeof(unsigned long long) * lines);
+    m->clock = 0;
+    m->hits = m->misses = m->evictions = 0;
+}
+
+static void model_touch(cache_model_t *m, unsigned long long addr, int alloc)
+{
+    unsigned long long tag = addr >> (m->s + m->b);
+    unsigned long long set = (addr >> m->b) & ((1ULL << m->s) - 1);
+    unsigned long long *tags = m->tags + set * m->E;
+    unsigned long long *stamps = m->stamps + set * m->E;
+    int i, victim = 0;
+
+    for (i = 0; i < m->E; i++) {
+        if (tags[i] == tag) {
+            m->hits++;
+            stamps[i] = ++m->clock;
+            return;
+        }
+        /* Invalid lines have stamp 0, so they are picked first */
+        if (stamps[i] < stamps[victim])
+            victim = i;
+    }
+
+    m->misses++;
+    if (!alloc)
+        return;
+    if (tags[victim] != INVALID_TAG)
+        m->evictions++;
+    tags[victim] = tag;
+    stamps[victim] = ++m->clock;
+}
+
+/*
+ * cache_model_access - Simulate one trace record
+ */
+void cache_model_access(cache_model_t *m, char op, unsigned long long addr)
+{
+    switch (op) {
+    case 'M':
+        model_touch(m, addr, 1);
+        /* fall through */
+    case 'L':
+    case 'S':
+        model_touch(m, addr, 1);
+        break;
+    case 'N':
+        model_touch(m, addr, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * cache_model_free - Release the cache
+ */
+void cache_model_free(cache_model_t *m)
+{
+    free(m->tags);
+    free(m->stamps);
+}
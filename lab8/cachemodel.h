@@ -0,0 +1,33 @@
+/*
+ * cachemodel.h - A small LRU cache model that tools link in to count
+ *     hits, misses and evictions without running a separate simulator.
+ *     It follows the reference simulator: an M access is a load and a
+ *     store, and the least recently used line of a full set is evicted.
+ *     An N access is a non-temporal store, which counts like a store but
+ *     does not bring the line in when it misses.
+ */
+#ifndef CACHEMODEL_H
+#define CACHEMODEL_H
+
+typedef struct cache_model {
+    int s, E, b;
+    unsigned long long *tags;       /* 2^s sets of E tags, ~0 if invalid */
+    unsigned long long *stamps;     /* time of the last use of each line */
+    unsigned long long clock;
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+} cache_model_t;
+
+/* Set up an empty cache with 2^s sets of E lines of 2^b bytes */
+void cache_model_init(cache_model_t *m, int s, int E, int b);
+
+/* Drop every line and zero the counters */
+void cache_model_reset(cache_model_t *m);
+
+/* Simulate one access; op is L, S or M as in a trace, or N */
+void cache_model_access(cache_model_t *m, char op, unsigned long long addr);
+
+void cache_model_free(cache_model_t *m);
+
+#endif /* CACHEMODEL_H */
@@ -2,66 +2,237 @@
     沈玮杭
     519021910766
 */
+#define _DEFAULT_SOURCE
 #include "cachelab.h"
+#include "tracefmt.h"
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define MAX_FILENAME_LENGTH 200
+#define MAX_SWEEP 64
+#define MAX_LEVELS 8
 
 int verbose, s, S, E, b;
-int hit_count, miss_count, eviction_count;
-uint64_t curTime;
 char t[MAX_FILENAME_LENGTH];
-FILE *file;
+int fd;
 
 typedef uint64_t addr_t;
 
+/*
+*   one parsed trace record, replayed in batches of BATCH_SIZE
+*/
 typedef struct
 {
-    uint64_t valid;
-    uint64_t tag;
-    uint64_t timeStamp;
-} cache_line;
+    addr_t addr;
+    uint32_t size;
+    char op;
+} mem_record;
+
+#define BATCH_SIZE 4096
+#define RING_SIZE (1 << 20)
+
+// the parser fills one buffer while the other one is being replayed
+mem_record batches[2][BATCH_SIZE];
+mem_record *batch = batches[0];
+int batch_len;
+
+/*
+*   cache is kept as structure-of-arrays: every set owns a contiguous row
+*   of `ways` tags (E rounded up to a whole vector), next to whatever the
+*   replacement policy keeps. An invalid line holds INVALID_TAG and the padding slots
+*   hold PAD_TAG; neither can be produced by GET_TAG since s + b > 0.
+*/
+#define INVALID_TAG UINT64_MAX
+#define PAD_TAG     (UINT64_MAX - 1)
+#define WAY_ALIGN   4
+
+/*
+*   replacement policies; each keeps only the per-set state it needs
+*/
+enum { POLICY_LRU, POLICY_FIFO, POLICY_RANDOM, POLICY_PLRU,
+       POLICY_SRRIP, POLICY_BRRIP };
+
+const char *policy_names[] = { "lru", "fifo", "random", "plru",
+                               "srrip", "brrip" };
 
-cache_line **cache;
+#define NUM_POLICIES (int)(sizeof(policy_names) / sizeof(policy_names[0]))
+#define RRPV_MAX 3
+#define BRRIP_LONG_ODDS 32
 
-#define GET_TAG(addr) (addr >> (s + b))
-#define GET_SET(addr) ((addr >> b) & ((-1U) >> (64 - s)))
-#define GET_BLOCK(addr) (addr & ((-1U) >> (64 - b)))
+int policy;
+
+// stores that miss fetch their line (write-allocate) or go around it
+int write_allocate = 1;
+int report_traffic;
+
+typedef struct
+{
+    int s, S, E, b;
+    int ways;
+    int policy;
+    uint64_t *tags;
+    uint64_t *stamps;       // LRU: time of the last use, per way
+    uint32_t *next;         // FIFO: next way to replace, per set
+    uint64_t *plru;         // PLRU: E - 1 tree bits, per set
+    uint8_t *rrpv;          // RRIP: re-reference prediction, per way
+    uint8_t *dirty;         // line written since its fill, per way
+    uint64_t curTime;
+    uint64_t seed;          // random and BRRIP draws
+    int incl;               // hierarchy: inclusion towards the levels above
+    int hit_count, miss_count, eviction_count;
+    int writeback_count;    // dirty evictions
+    int invalidation_count;
+    uint64_t read_bytes, write_bytes;   // traffic to the next level
+} cache_t;
+
+cache_t cache;
+
+#define GET_TAG(c, addr) ((addr) >> ((c)->s + (c)->b))
+#define GET_SET(c, addr) (((addr) >> (c)->b) & ((1ULL << (c)->s) - 1))
+#define GET_BLOCK(c, addr) ((addr) & ((1ULL << (c)->b) - 1))
 
 void usage()
 {
-    printf( "Usage: ./csim-ref [-hv] -s <num> -E <num> -b <num> -t <file>\n"
+    printf( "Usage: ./csim-ref [-hv] -s <num> -E <num> -b <num> -t <file> [-p <name>]\n"
             "Options:\n"
             "  -h         Print this help message.\n"
             "  -v         Optional verbose flag.\n"
             "  -s <num>   Number of set index bits.\n"
             "  -E <num>   Number of lines per set.\n"
             "  -b <num>   Number of block offset bits.\n"
-            "  -t <file>  Trace file.\n\n"
+            "  -t <file>  Trace file, text or binary (see traceconv), '-'\n"
+            "             reads the trace from stdin.\n"
+            "  -p <name>  Replacement policy: lru (default), fifo, random,\n"
+            "             plru (E a power of two up to 64), srrip or brrip.\n"
+            "  -w <mode>  Store misses: allocate (default) fetches the line,\n"
+            "             noallocate writes around the cache.\n"
+            "  -m         Report dirty evictions and memory traffic in bytes.\n"
+            "  -j <num>   Worker threads. A sweep spreads configurations\n"
+            "             across them (default: one per cpu); a single cache\n"
+            "             is split by set index (default: no split). Not\n"
+            "             allowed with -l.\n\n"
+            "Sweep mode:\n"
+            "  -s, -E and -b also take lists such as 1,2,4 and ranges such\n"
+            "  as 1-8 (E ranges double at every step). The trace is parsed\n"
+            "  once and a table is printed for every configuration.\n\n"
+            "Hierarchy mode:\n"
+            "  -l <s:E:b[:policy[:inclusion]]>\n"
+            "             Add a cache level, L1 first. Inclusion towards the\n"
+            "             levels above is nine (default), inclusive or exclusive.\n"
+            "             Replaces -s, -E and -b.\n\n"
             "Examples:\n"
             "  linux>  ./csim-ref -s 4 -E 1 -b 4 -t traces/yi.trace\n"
-            "  linux>  ./csim-ref -v -s 8 -E 2 -b 4 -t traces/yi.trace\n");
+            "  linux>  ./csim-ref -v -s 8 -E 2 -b 4 -t traces/yi.trace\n"
+            "  linux>  ./csim-ref -s 1-6 -E 1-16 -b 4,5 -t traces/long.trace\n"
+            "  linux>  ./csim-ref -s 4 -E 8 -b 4 -p plru -t traces/long.trace\n"
+            "  linux>  ./csim-ref -l 6:8:6 -l 9:8:6:plru:inclusive -t traces/long.trace\n");
+}
+
+
+/*
+*   find the way among the first n of a set row holding key,
+*   -1 if there is none; n is a multiple of WAY_ALIGN
+*/
+static int find_way_scalar(const uint64_t *row, int n, uint64_t key)
+{
+    for (int j = 0; j < n; ++j)
+        if (row[j] == key)
+            return j;
+    return -1;
+}
+
+#ifdef __x86_64__
+/*
+*   SSE2 has no 64-bit compare, so compare the 32-bit halves and
+*   require both of them to match
+*/
+static int find_way_sse2(const uint64_t *row, int n, uint64_t key)
+{
+    __m128i k = _mm_set1_epi64x((long long)key);
+    for (int j = 0; j < n; j += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + j));
+        __m128i eq = _mm_cmpeq_epi32(v, k);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int find_way_avx2(const uint64_t *row, int n, uint64_t key)
+{
+    __m256i k = _mm256_set1_epi64x((long long)key);
+    for (int j = 0; j < n; j += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + j));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, k)));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    return -1;
+}
+#endif
+
+int (*find_way)(const uint64_t *row, int n, uint64_t key) = find_way_scalar;
+
+/*
+*   pick the widest tag matcher the cpu supports
+*/
+void init_find_way()
+{
+#ifdef __x86_64__
+    find_way = __builtin_cpu_supports("avx2") ? find_way_avx2 : find_way_sse2;
+#endif
 }
 
 
 /*
 *   malloc space for cache
 */
-void init_cache()
+void init_cache(cache_t *c, int s, int E, int b, int policy)
 {
-    cache = (cache_line**)malloc(sizeof(cache_line*) * S);
-    for (int i = 0; i < S; ++i) {
-        cache[i] = (cache_line*)malloc(sizeof(cache_line) * E);
-        for (int j = 0; j < E; ++j) {
-            cache[i][j].valid = 0;
-            cache[i][j].tag = -1U;
-            cache[i][j].timeStamp = 0;
-        }
+    memset(c, 0, sizeof(cache_t));
+    c->s = s;
+    c->S = 1 << s;
+    c->E = E;
+    c->b = b;
+    c->policy = policy;
+    c->ways = (E + WAY_ALIGN - 1) / WAY_ALIGN * WAY_ALIGN;
+    c->seed = 0x9e3779b97f4a7c15ULL;
+    c->tags = (uint64_t*)malloc(sizeof(uint64_t) * c->S * c->ways);
+    c->dirty = (uint8_t*)calloc((size_t)c->S * c->ways, sizeof(uint8_t));
+    for (int i = 0; i < c->S; ++i)
+        for (int j = 0; j < c->ways; ++j)
+            c->tags[i * c->ways + j] = j < E ? INVALID_TAG : PAD_TAG;
+
+    switch (policy) {
+        case POLICY_LRU:
+            c->stamps = (uint64_t*)calloc((size_t)c->S * c->ways, sizeof(uint64_t));
+            break;
+        case POLICY_FIFO:
+            c->next = (uint32_t*)calloc(c->S, sizeof(uint32_t));
+            break;
+        case POLICY_PLRU:
+            c->plru = (uint64_t*)calloc(c->S, sizeof(uint64_t));
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            c->rrpv = (uint8_t*)calloc((size_t)c->S * c->ways, sizeof(uint8_t));
+            break;
+        default:
+            break;
     }
 }
 
@@ -69,65 +240,989 @@ void init_cache()
 /*
 *   free space for cache
 */
-void free_cache()
+void free_cache(cache_t *c)
+{
+    free(c->tags);
+    free(c->stamps);
+    free(c->next);
+    free(c->plru);
+    free(c->rrpv);
+    free(c->dirty);
+}
+
+/*
+*   xorshift64, deterministic so runs are reproducible
+*/
+static inline uint64_t next_random(cache_t *c)
 {
-    for (int j = 0; j < E; ++j)
-        free(cache[j]);
-    free(cache);
+    c->seed ^= c->seed << 13;
+    c->seed ^= c->seed >> 7;
+    c->seed ^= c->seed << 17;
+    return c->seed;
 }
 
 /*
-*   simulate one memory access to addr
+*   point every node on the path to way `way` of the PLRU tree away
+*   from it. Node i has children 2i+1 and 2i+2, the leaves are the
+*   ways, and a set bit means the victim lies in the right subtree.
 */
-void access_mem(addr_t addr)
+static inline void plru_touch(cache_t *c, uint64_t set, int way)
+{
+    uint64_t bits = c->plru[set];
+    int node = 0;
+    for (int half = c->E >> 1; half; half >>= 1) {
+        if (way & half) {
+            bits &= ~(1ULL << node);
+            node = 2 * node + 2;
+        } else {
+            bits |= 1ULL << node;
+            node = 2 * node + 1;
+        }
+    }
+    c->plru[set] = bits;
+}
+
+static inline int plru_victim(cache_t *c, uint64_t set)
+{
+    uint64_t bits = c->plru[set];
+    int node = 0, way = 0;
+    for (int half = c->E >> 1; half; half >>= 1) {
+        if (bits >> node & 1) {
+            way |= half;
+            node = 2 * node + 2;
+        } else
+            node = 2 * node + 1;
+    }
+    return way;
+}
+
+/*
+*   age the whole set until some way reaches RRPV_MAX, and pick it
+*/
+static inline int rrip_victim(cache_t *c, uint64_t set)
+{
+    uint8_t *rrpv = c->rrpv + set * c->ways;
+    for (;;) {
+        for (int j = 0; j < c->E; ++j)
+            if (rrpv[j] == RRPV_MAX)
+                return j;
+        for (int j = 0; j < c->E; ++j)
+            ++rrpv[j];
+    }
+}
+
+/*
+*   update replacement state after way `way` of set was used by a hit
+*/
+static inline void policy_hit(cache_t *c, uint64_t set, int way)
+{
+    switch (c->policy) {
+        case POLICY_LRU:
+            c->stamps[set * c->ways + way] = c->curTime++;
+            break;
+        case POLICY_PLRU:
+            plru_touch(c, set, way);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            c->rrpv[set * c->ways + way] = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+*   choose the way to evict from a full set
+*/
+static inline int policy_victim(cache_t *c, uint64_t set)
+{
+    int pos = 0;
+    switch (c->policy) {
+        case POLICY_LRU: {
+            // the smaller the time stamp, the older the cache line
+            uint64_t *stamp = c->stamps + set * c->ways;
+            for (int j = 1; j < c->E; ++j)
+                if (stamp[j] < stamp[pos])
+                    pos = j;
+            break;
+        }
+        case POLICY_FIFO:
+            pos = c->next[set];
+            c->next[set] = pos + 1 == c->E ? 0 : pos + 1;
+            break;
+        case POLICY_RANDOM:
+            pos = next_random(c) % c->E;
+            break;
+        case POLICY_PLRU:
+            pos = plru_victim(c, set);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            pos = rrip_victim(c, set);
+            break;
+        default:
+            break;
+    }
+    return pos;
+}
+
+/*
+*   update replacement state after a new line was filled into way `way`
+*/
+static inline void policy_fill(cache_t *c, uint64_t set, int way)
+{
+    switch (c->policy) {
+        case POLICY_LRU:
+            c->stamps[set * c->ways + way] = c->curTime++;
+            break;
+        case POLICY_PLRU:
+            plru_touch(c, set, way);
+            break;
+        case POLICY_SRRIP:
+            c->rrpv[set * c->ways + way] = RRPV_MAX - 1;
+            break;
+        case POLICY_BRRIP:
+            // bimodal: insert at distant re-reference, rarely at long
+            c->rrpv[set * c->ways + way] =
+                next_random(c) % BRRIP_LONG_ODDS ? RRPV_MAX : RRPV_MAX - 1;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+*   simulate one memory access to addr, a store of size bytes if write
+*   is set. Lines come from and dirty lines go back to memory, which is
+*   counted in read_bytes/write_bytes.
+*/
+void access_mem(cache_t *c, addr_t addr, int write, int size)
 {
     if (verbose)
         printf("try to access %lx\n", addr);
 
     // get tag and set by address
-    uint64_t tag = GET_TAG(addr);
-    uint64_t set = GET_SET(addr);
+    uint64_t tag = GET_TAG(c, addr);
+    uint64_t set = GET_SET(c, addr);
     if (verbose)
         printf("tag: %lx, set: %lx\n", tag, set);
 
-    // the smaller the time stamp, the older the cache line
-    uint64_t oldest_time = curTime;
-    int oldest_pos = 0;
-    int empty_pos = -1;
-
+    uint64_t *row = c->tags + set * c->ways;
 
     // find if the data is in the cache
-    // find the oldest cache line that have not been accessed as well
-    // find if there is an invalid cache line as well
-    for (int j = 0; j < E; ++j) {
-        if (cache[set][j].valid) {
-            if (cache[set][j].timeStamp < oldest_time) {
-                oldest_time = cache[set][j].timeStamp;
-                oldest_pos = j;
+    int pos = find_way(row, c->ways, tag);
+    if (pos != -1) {
+        policy_hit(c, set, pos);
+        c->dirty[set * c->ways + pos] |= write;
+        ++c->hit_count;
+        return;
+    }
+    ++c->miss_count;
+
+    if (write && !write_allocate) {
+        c->write_bytes += size;
+        return;
+    }
+
+    // if there is an invalid cache line
+    pos = find_way(row, c->ways, INVALID_TAG);
+    if (pos == -1) {
+        // no invalid cache line, ask the policy for a victim
+        ++c->eviction_count;
+        pos = policy_victim(c, set);
+        if (c->dirty[set * c->ways + pos]) {
+            ++c->writeback_count;
+            c->write_bytes += 1ULL << c->b;
+        }
+    }
+    row[pos] = tag;
+    c->dirty[set * c->ways + pos] = write;
+    c->read_bytes += 1ULL << c->b;
+    policy_fill(c, set, pos);
+}
+
+/*
+*   replay records into cache c
+*/
+void replay_model(cache_t *c, const mem_record *r, int n)
+{
+    for (int i = 0; i < n; ++i, ++r) {
+        if (verbose)
+            printf("op:%c, addr:%lx, size:%u\n", r->op, r->addr, r->size);
+        switch (r->op) {
+            case 'L':
+                access_mem(c, r->addr, 0, r->size);
+                break;
+            case 'M':
+                access_mem(c, r->addr, 0, r->size);
+            case 'S':
+                access_mem(c, r->addr, 1, r->size);
+            default:
+                break;
+        }
+    }
+}
+
+void replay_cache(const mem_record *r, int n)
+{
+    replay_model(&cache, r, n);
+}
+
+
+/*
+*   sweep mode: every (s, b) pair is one Mattson stack-distance model.
+*   Each set keeps its distinct tags most recently used first, so a hit
+*   at depth d is a hit for every E >= d under LRU. Stacks are cut at
+*   the largest E swept; deeper lines miss in every swept cache anyway.
+*   Other policies have no stack property, so they sweep one full cache
+*   model per configuration instead.
+*/
+typedef struct
+{
+    int s, b;
+    int depth;              // largest E swept, the stack length
+    int ways;               // depth rounded up to WAY_ALIGN
+    uint64_t *stack;        // S rows of `ways` tags, INVALID_TAG if unused
+    uint32_t *fill;         // stack entries in use, per set
+    uint64_t *hit_hist;     // hit_hist[d]: hits at depth d (1-based)
+    uint64_t *evict_hist;   // evict_hist[k]: misses that evict for E <= k
+    uint64_t accesses;
+} sweep_group;
+
+int sweep_s[MAX_SWEEP], sweep_E[MAX_SWEEP], sweep_b[MAX_SWEEP];
+int n_s, n_E, n_b;
+sweep_group *groups;
+cache_t *models;
+int n_groups;
+
+void init_group(sweep_group *g, int s, int depth, int b)
+{
+    memset(g, 0, sizeof(sweep_group));
+    g->s = s;
+    g->b = b;
+    g->depth = depth;
+    g->ways = (depth + WAY_ALIGN - 1) / WAY_ALIGN * WAY_ALIGN;
+    g->stack = (uint64_t*)malloc(sizeof(uint64_t) * ((size_t)g->ways << s));
+    for (size_t i = 0; i < ((size_t)g->ways << s); ++i)
+        g->stack[i] = INVALID_TAG;
+    g->fill = (uint32_t*)calloc((size_t)1 << s, sizeof(uint32_t));
+    g->hit_hist = (uint64_t*)calloc(depth + 1, sizeof(uint64_t));
+    g->evict_hist = (uint64_t*)calloc(depth + 1, sizeof(uint64_t));
+}
+
+void free_group(sweep_group *g)
+{
+    free(g->stack);
+    free(g->fill);
+    free(g->hit_hist);
+    free(g->evict_hist);
+}
+
+void access_group(sweep_group *g, addr_t addr)
+{
+    uint64_t tag = addr >> (g->s + g->b);
+    uint64_t set = (addr >> g->b) & ((1ULL << g->s) - 1);
+    uint64_t *row = g->stack + set * g->ways;
+    uint32_t *fill = g->fill + set;
+
+    ++g->accesses;
+    int pos = find_way(row, g->ways, tag);
+    if (pos != -1) {
+        // a hit for E > pos, an eviction for E <= pos
+        ++g->hit_hist[pos + 1];
+        ++g->evict_hist[pos];
+    } else {
+        // a miss everywhere, an eviction wherever the set is full
+        ++g->evict_hist[*fill];
+        pos = *fill == (uint32_t)g->depth ? g->depth - 1 : (*fill)++;
+    }
+    memmove(row + 1, row, sizeof(uint64_t) * pos);
+    row[0] = tag;
+}
+
+void replay_group(sweep_group *g, const mem_record *r, int n)
+{
+    for (int i = 0; i < n; ++i, ++r) {
+        switch (r->op) {
+            case 'M':
+                access_group(g, r->addr);
+            case 'L':
+            case 'S':
+                access_group(g, r->addr);
+            default:
+                break;
+        }
+    }
+}
+
+/*
+*   worker pool shared by the sweep and the sharded replay. Every
+*   worker runs work(id) on each published batch. The two barriers hand
+*   batches over without locks: `done` waits for the previous batch,
+*   `start` releases the next one.
+*/
+int n_threads;
+int n_workers = 1;
+pthread_t *workers;
+pthread_barrier_t batch_done, batch_start;
+void (*work)(int id);
+const mem_record *job;
+int job_len;
+int stopping;
+
+void *worker_main(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    for (;;) {
+        pthread_barrier_wait(&batch_done);
+        pthread_barrier_wait(&batch_start);
+        if (stopping)
+            break;
+        work(id);
+    }
+    return NULL;
+}
+
+void start_workers(int n, void (*fn)(int))
+{
+    n_workers = n;
+    work = fn;
+    if (n_workers == 1)
+        return;
+    pthread_barrier_init(&batch_done, NULL, n_workers + 1);
+    pthread_barrier_init(&batch_start, NULL, n_workers + 1);
+    workers = (pthread_t*)malloc(sizeof(pthread_t) * n_workers);
+    for (int i = 0; i < n_workers; ++i)
+        pthread_create(&workers[i], NULL, worker_main, (void*)(intptr_t)i);
+}
+
+/*
+*   wait for the workers to finish the last batch, then hand them r
+*/
+void publish_batch(const mem_record *r, int n)
+{
+    if (n_workers == 1) {
+        job = r;
+        job_len = n;
+        work(0);
+        return;
+    }
+    pthread_barrier_wait(&batch_done);
+    job = r;
+    job_len = n;
+    pthread_barrier_wait(&batch_start);
+}
+
+void stop_workers()
+{
+    if (n_workers == 1)
+        return;
+    pthread_barrier_wait(&batch_done);
+    stopping = 1;
+    pthread_barrier_wait(&batch_start);
+    for (int i = 0; i < n_workers; ++i)
+        pthread_join(workers[i], NULL);
+    pthread_barrier_destroy(&batch_done);
+    pthread_barrier_destroy(&batch_start);
+    free(workers);
+}
+
+/*
+*   sharded replay: accesses to different sets never interact, so
+*   worker i simulates the sets with set % n_workers == i. The shards
+*   share the cache arrays but keep their own counters and clocks, and
+*   each batch is bucketed into per-shard queues while the workers are
+*   still busy with the previous one. Only random and BRRIP draws
+*   differ from a single-threaded run.
+*/
+cache_t *shards;
+mem_record *shard_queue[2];
+int *shard_len[2];
+int shard_back;
+
+void shard_work(int id)
+{
+    // the published job is the queue base of the batch to replay
+    int front = job == shard_queue[0] ? 0 : 1;
+    replay_model(&shards[id], shard_queue[front] + (size_t)id * BATCH_SIZE,
+                 shard_len[front][id]);
+}
+
+void replay_sharded(const mem_record *r, int n)
+{
+    mem_record *queue = shard_queue[shard_back];
+    int *len = shard_len[shard_back];
+    memset(len, 0, sizeof(int) * n_workers);
+    for (int i = 0; i < n; ++i, ++r) {
+        int id = GET_SET(&cache, r->addr) % n_workers;
+        queue[(size_t)id * BATCH_SIZE + len[id]++] = *r;
+    }
+    publish_batch(queue, n);
+    shard_back = !shard_back;
+}
+
+void start_shards()
+{
+    int n = n_threads < cache.S ? n_threads : cache.S;
+    shards = (cache_t*)malloc(sizeof(cache_t) * n);
+    for (int i = 0; i < n; ++i) {
+        shards[i] = cache;
+        shards[i].seed += i;
+    }
+    for (int i = 0; i < 2; ++i) {
+        shard_queue[i] = (mem_record*)malloc(sizeof(mem_record) * BATCH_SIZE * n);
+        shard_len[i] = (int*)calloc(n, sizeof(int));
+    }
+    start_workers(n, shard_work);
+}
+
+/*
+*   fold the shard counters back into the cache
+*/
+void finish_shards()
+{
+    stop_workers();
+    for (int i = 0; i < n_workers; ++i) {
+        cache.hit_count += shards[i].hit_count;
+        cache.miss_count += shards[i].miss_count;
+        cache.eviction_count += shards[i].eviction_count;
+        cache.writeback_count += shards[i].writeback_count;
+        cache.read_bytes += shards[i].read_bytes;
+        cache.write_bytes += shards[i].write_bytes;
+    }
+    for (int i = 0; i < 2; ++i) {
+        free(shard_queue[i]);
+        free(shard_len[i]);
+    }
+    free(shards);
+}
+
+/*
+*   sweep: worker i owns groups (or models) i, i + n_workers, ...
+*/
+void replay_unit(int i, const mem_record *r, int n)
+{
+    if (groups)
+        replay_group(&groups[i], r, n);
+    else
+        replay_model(&models[i], r, n);
+}
+
+void sweep_work(int id)
+{
+    for (int i = id; i < n_groups; i += n_workers)
+        replay_unit(i, job, job_len);
+}
+
+void start_sweep()
+{
+    int depth = 1;
+    for (int i = 0; i < n_E; ++i)
+        if (sweep_E[i] > depth)
+            depth = sweep_E[i];
+
+    // without write-allocate, stores that miss leave smaller caches
+    // behind, which breaks the stack property
+    if (policy == POLICY_LRU && write_allocate) {
+        n_groups = n_s * n_b;
+        groups = (sweep_group*)malloc(sizeof(sweep_group) * n_groups);
+        for (int i = 0; i < n_s; ++i)
+            for (int j = 0; j < n_b; ++j)
+                init_group(&groups[i * n_b + j], sweep_s[i], depth, sweep_b[j]);
+    } else {
+        n_groups = n_s * n_E * n_b;
+        models = (cache_t*)malloc(sizeof(cache_t) * n_groups);
+        for (int i = 0; i < n_s; ++i)
+            for (int k = 0; k < n_E; ++k)
+                for (int j = 0; j < n_b; ++j)
+                    init_cache(&models[(i * n_E + k) * n_b + j],
+                               sweep_s[i], sweep_E[k], sweep_b[j], policy);
+    }
+
+    long n = n_threads;
+    if (!n)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    start_workers(n < 1 ? 1 : n < n_groups ? n : n_groups, sweep_work);
+}
+
+/*
+*   print one row per configuration, for LRU derived from the stack
+*   histograms
+*/
+void print_sweep()
+{
+    printf("%4s %4s %4s %12s %12s %12s\n",
+           "s", "E", "b", "hits", "misses", "evictions");
+    for (int i = 0; i < n_s; ++i)
+        for (int k = 0; k < n_E; ++k)
+            for (int j = 0; j < n_b; ++j) {
+                uint64_t hits = 0, misses = 0, evictions = 0;
+                if (groups) {
+                    sweep_group *g = &groups[i * n_b + j];
+                    for (int d = 1; d <= sweep_E[k]; ++d)
+                        hits += g->hit_hist[d];
+                    for (int d = sweep_E[k]; d <= g->depth; ++d)
+                        evictions += g->evict_hist[d];
+                    misses = g->accesses - hits;
+                } else {
+                    cache_t *c = &models[(i * n_E + k) * n_b + j];
+                    hits = c->hit_count;
+                    misses = c->miss_count;
+                    evictions = c->eviction_count;
+                }
+                printf("%4d %4d %4d %12lu %12lu %12lu\n",
+                       sweep_s[i], sweep_E[k], sweep_b[j],
+                       hits, misses, evictions);
             }
-            if (cache[set][j].tag == tag) {
-                cache[set][j].timeStamp = curTime++;
-                ++hit_count;
-                return;
+
+    for (int i = 0; i < n_groups; ++i) {
+        if (groups)
+            free_group(&groups[i]);
+        else
+            free_cache(&models[i]);
+    }
+    free(groups);
+    free(models);
+}
+
+/*
+*   parse a list such as "1,3,5-8" into vals; a range lo-hi steps by
+*   one, or doubles when doubling is set. Returns -1 on a bad list.
+*/
+int parse_list(const char *arg, int *vals, int *n, int doubling)
+{
+    *n = 0;
+    while (*arg) {
+        char *end;
+        long lo = strtol(arg, &end, 10), hi = lo;
+        if (end == arg)
+            return -1;
+        if (*end == '-') {
+            arg = end + 1;
+            hi = strtol(arg, &end, 10);
+            if (end == arg)
+                return -1;
+        }
+        if (lo <= 0 || hi < lo)
+            return -1;
+        for (long v = lo; v <= hi; v = doubling ? v * 2 : v + 1) {
+            if (*n == MAX_SWEEP)
+                return -1;
+            vals[(*n)++] = (int)v;
+        }
+        if (*end == ',')
+            ++end;
+        else if (*end)
+            return -1;
+        arg = end;
+    }
+    return *n ? 0 : -1;
+}
+
+/*
+*   bytes moved between the last cache and memory, which bounds the
+*   DRAM bandwidth the trace needs
+*/
+void print_traffic(uint64_t read, uint64_t write, uint64_t accesses)
+{
+    printf("memory read bytes:%lu write bytes:%lu", read, write);
+    if (accesses)
+        printf(" (%.2f bytes/access)", (double)(read + write) / accesses);
+    printf("\n");
+}
+
+/*
+*   hierarchy mode: levels[0] is L1 and every miss goes on to the next
+*   level, memory after the last one. A level's inclusion setting says
+*   how it relates to the levels above it:
+*     nine       fills on misses, its evictions leave the levels above alone
+*     inclusive  its evictions back-invalidate the levels above
+*     exclusive  a victim cache: filled only by evictions from above, a
+*                hit moves the line up and out of it
+*   Dirty lines are written back to the next level when evicted. Without
+*   write-allocate a store miss is passed down as a write of its size.
+*/
+enum { INCL_NINE, INCL_INCLUSIVE, INCL_EXCLUSIVE };
+const char *incl_names[] = { "nine", "inclusive", "exclusive" };
+#define NUM_INCLS (int)(sizeof(incl_names) / sizeof(incl_names[0]))
+
+enum { EV_READ, EV_WRITE, EV_VICTIM };
+
+typedef struct
+{
+    addr_t addr;
+    uint8_t kind;
+    uint8_t dirty;
+    uint32_t size;          // bytes of a write passed down
+} level_event;
+
+/*
+*   traffic into a level is queued and replayed level by level when
+*   that is exact, i.e. when neither that level nor any below it sends
+*   anything back up (no inclusive or exclusive level). Otherwise the
+*   access descends through the levels at once.
+*/
+typedef struct
+{
+    level_event *ev;
+    int len, cap;
+} level_queue;
+
+cache_t levels[MAX_LEVELS];
+level_queue queues[MAX_LEVELS];
+int deferred[MAX_LEVELS];
+int n_levels;
+uint64_t mem_read_bytes, mem_write_bytes;
+
+int level_access(int k, addr_t addr, int kind, int dirty, int size);
+
+/*
+*   send one event to level k, or to memory past the last level
+*/
+static int forward(int k, addr_t addr, int kind, int dirty, int size)
+{
+    if (k == n_levels) {
+        uint64_t line = 1ULL << levels[n_levels - 1].b;
+        if (kind == EV_READ)
+            mem_read_bytes += line;
+        else if (kind == EV_WRITE)
+            mem_write_bytes += size;
+        else if (dirty)
+            mem_write_bytes += line;
+        return 0;
+    }
+    if (!deferred[k])
+        return level_access(k, addr, kind, dirty, size);
+
+    level_queue *q = &queues[k];
+    if (q->len == q->cap) {
+        q->cap = q->cap ? q->cap * 2 : BATCH_SIZE;
+        q->ev = (level_event*)realloc(q->ev, sizeof(level_event) * q->cap);
+    }
+    q->ev[q->len].addr = addr;
+    q->ev[q->len].kind = kind;
+    q->ev[q->len].dirty = dirty;
+    q->ev[q->len].size = size;
+    ++q->len;
+    return 0;
+}
+
+/*
+*   drop the line holding addr from c; returns its dirty bit, -1 if absent
+*/
+static int invalidate_line(cache_t *c, addr_t addr)
+{
+    uint64_t set = GET_SET(c, addr);
+    uint64_t *row = c->tags + set * c->ways;
+    int pos = find_way(row, c->ways, GET_TAG(c, addr));
+    if (pos == -1)
+        return -1;
+    int d = c->dirty[set * c->ways + pos];
+    row[pos] = INVALID_TAG;
+    c->dirty[set * c->ways + pos] = 0;
+    return d;
+}
+
+/*
+*   put the line holding addr into level k, evicting if the set is full
+*/
+static void fill_line(int k, addr_t addr, int dirty)
+{
+    cache_t *c = &levels[k];
+    uint64_t set = GET_SET(c, addr);
+    uint64_t *row = c->tags + set * c->ways;
+
+    int pos = find_way(row, c->ways, INVALID_TAG);
+    addr_t victim = 0;
+    int victim_dirty = -1;
+    if (pos == -1) {
+        ++c->eviction_count;
+        pos = policy_victim(c, set);
+        victim = (row[pos] << (c->s + c->b)) | (set << c->b);
+        victim_dirty = c->dirty[set * c->ways + pos];
+    }
+    row[pos] = GET_TAG(c, addr);
+    c->dirty[set * c->ways + pos] = dirty;
+    policy_fill(c, set, pos);
+
+    if (victim_dirty == -1)
+        return;
+    if (c->incl == INCL_INCLUSIVE)
+        for (int j = 0; j < k; ++j) {
+            int d = invalidate_line(&levels[j], victim);
+            if (d != -1) {
+                ++levels[j].invalidation_count;
+                victim_dirty |= d;
             }
-        } else
-            empty_pos = j;
+        }
+    if (victim_dirty)
+        ++c->writeback_count;
+    forward(k + 1, victim, EV_VICTIM, victim_dirty, 0);
+}
+
+/*
+*   one event at level k. For a read or write from above, returns the
+*   dirty bit of a line that an exclusive level hands up.
+*/
+int level_access(int k, addr_t addr, int kind, int dirty, int size)
+{
+    cache_t *c = &levels[k];
+    uint64_t set = GET_SET(c, addr);
+    uint64_t *row = c->tags + set * c->ways;
+    int pos = find_way(row, c->ways, GET_TAG(c, addr));
+    int exclusive = k > 0 && c->incl == INCL_EXCLUSIVE;
+
+    if (kind == EV_VICTIM) {
+        // only a victim cache keeps clean lines evicted from above
+        if (pos != -1)
+            c->dirty[set * c->ways + pos] |= dirty;
+        else if (dirty || exclusive)
+            fill_line(k, addr, dirty);
+        return 0;
     }
-    ++miss_count;
 
-    // if there is an invalid cache line
-    if (empty_pos != -1) {
-        cache[set][empty_pos].valid = 1;
-        cache[set][empty_pos].tag = tag;
-        cache[set][empty_pos].timeStamp = curTime++;
+    if (pos != -1) {
+        ++c->hit_count;
+        if (exclusive && (kind == EV_READ || write_allocate))
+            return invalidate_line(c, addr);
+        policy_hit(c, set, pos);
+        if (kind == EV_WRITE)
+            c->dirty[set * c->ways + pos] = 1;
+        return 0;
+    }
+
+    ++c->miss_count;
+    if (kind == EV_WRITE && !write_allocate)
+        return forward(k + 1, addr, EV_WRITE, 0, size);
+    int d = forward(k + 1, addr, EV_READ, 0, 0);
+    if (exclusive)
+        return d;
+    fill_line(k, addr, d || kind == EV_WRITE);
+    return 0;
+}
+
+/*
+*   replay records into L1, then drain the queued levels in order
+*/
+void replay_levels(const mem_record *r, int n)
+{
+    for (int i = 0; i < n; ++i, ++r) {
+        switch (r->op) {
+            case 'L':
+                forward(0, r->addr, EV_READ, 0, r->size);
+                break;
+            case 'M':
+                forward(0, r->addr, EV_READ, 0, r->size);
+            case 'S':
+                forward(0, r->addr, EV_WRITE, 0, r->size);
+            default:
+                break;
+        }
+    }
+    for (int k = 0; k < n_levels; ++k) {
+        level_queue *q = &queues[k];
+        for (int i = 0; i < q->len; ++i)
+            level_access(k, q->ev[i].addr, q->ev[i].kind,
+                         q->ev[i].dirty, q->ev[i].size);
+        q->len = 0;
+    }
+}
+
+/*
+*   parse a level description s:E:b[:policy[:inclusion]] into levels[]
+*/
+int add_level(const char *arg)
+{
+    char buf[64], *field[5] = { NULL };
+    int nf = 0;
+    if (n_levels == MAX_LEVELS || strlen(arg) >= sizeof(buf))
+        return -1;
+    strcpy(buf, arg);
+    for (char *p = strtok(buf, ":"); p && nf < 5; p = strtok(NULL, ":"))
+        field[nf++] = p;
+    if (nf < 3)
+        return -1;
+
+    int ls = atoi(field[0]), lE = atoi(field[1]), lb = atoi(field[2]);
+    int lp = POLICY_LRU, li = INCL_NINE;
+    if (field[3]) {
+        for (lp = 0; lp < NUM_POLICIES; ++lp)
+            if (!strcmp(field[3], policy_names[lp]))
+                break;
+        if (lp == NUM_POLICIES)
+            return -1;
+    }
+    if (field[4]) {
+        for (li = 0; li < NUM_INCLS; ++li)
+            if (!strcmp(field[4], incl_names[li]))
+                break;
+        if (li == NUM_INCLS)
+            return -1;
+    }
+    // s + b > 0 keeps INVALID_TAG and PAD_TAG out of reach of GET_TAG
+    if (ls < 0 || lE <= 0 || lb < 0 || ls + lb == 0 ||
+        (lp == POLICY_PLRU && (lE > 64 || (lE & (lE - 1)))))
+        return -1;
+
+    init_cache(&levels[n_levels], ls, lE, lb, lp);
+    levels[n_levels].incl = li;
+    ++n_levels;
+    return 0;
+}
+
+void start_levels()
+{
+    // a level may be queued if it and everything below it is nine
+    for (int k = n_levels - 1; k > 0 && levels[k].incl == INCL_NINE; --k)
+        deferred[k] = 1;
+}
+
+void print_levels()
+{
+    printf("%-5s %4s %4s %4s %6s %9s %12s %12s %12s %12s %12s\n",
+           "level", "s", "E", "b", "policy", "inclusion", "hits", "misses",
+           "evictions", "writebacks", "invalidated");
+    for (int k = 0; k < n_levels; ++k) {
+        cache_t *c = &levels[k];
+        printf("L%-4d %4d %4d %4d %6s %9s %12d %12d %12d %12d %12d\n",
+               k + 1, c->s, c->E, c->b, policy_names[c->policy],
+               k ? incl_names[c->incl] : "-", c->hit_count, c->miss_count,
+               c->eviction_count, c->writeback_count, c->invalidation_count);
+        free_cache(c);
+        free(queues[k].ev);
+    }
+    print_traffic(mem_read_bytes, mem_write_bytes,
+                  levels[0].hit_count + levels[0].miss_count);
+}
+
+void (*replay)(const mem_record *r, int n) = replay_cache;
+
+/*
+*   hand the current batch to the simulator and start filling the other
+*/
+void flush_batch()
+{
+    if (!batch_len)
         return;
+    replay(batch, batch_len);
+    batch = batch == batches[0] ? batches[1] : batches[0];
+    batch_len = 0;
+}
+
+static inline void push_record(char op, addr_t addr, uint32_t size)
+{
+    batch[batch_len].addr = addr;
+    batch[batch_len].size = size;
+    batch[batch_len].op = op;
+    if (++batch_len == BATCH_SIZE)
+        flush_batch();
+}
+
+/*
+*   parse the ` op addr,size` records in [p, end) into the batch.
+*   Only whole lines are consumed unless eof is set; the start of the
+*   first unconsumed line is returned. Lines that are not records
+*   (valgrind banners, instruction fetches) are skipped.
+*/
+const char *parse_text(const char *p, const char *end, int eof)
+{
+    char op;
+    addr_t addr;
+    uint32_t size;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            if (!eof)
+                return p;
+            nl = end;
+        }
+        if (trace_parse_line(p, nl, &op, &addr, &size) && op != 'I')
+            push_record(op, addr, size);
+        p = nl + 1;
+    }
+    return end;
+}
+
+/*
+*   parse binary records (see tracefmt.h) in [p, end) into the batch,
+*   returning the start of a record cut off by the end of the buffer
+*/
+uint64_t prev_addr;
+
+const char *parse_binary(const char *p, const char *end)
+{
+    const uint8_t *q = (const uint8_t *)p, *next;
+    char op;
+    addr_t addr;
+    uint32_t size;
+
+    while ((next = trace_decode(q, (const uint8_t *)end, &prev_addr,
+                                &op, &addr, &size))) {
+        if (op != 'I')
+            push_record(op, addr, size);
+        q = next;
+    }
+    return (const char *)q;
+}
+
+int binary_trace;
+
+const char *parse_trace(const char *p, const char *end, int eof)
+{
+    return binary_trace ? parse_binary(p, end) : parse_text(p, end, eof);
+}
+
+/*
+*   replay a regular file by mapping it, without copying a byte
+*/
+int replay_mapped(size_t len)
+{
+    if (len == 0)
+        return 0;
+    const char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    madvise((void *)base, len, MADV_SEQUENTIAL);
+    const char *p = base;
+    if ((binary_trace = trace_is_binary(base, len)))
+        p += TRACE_MAGIC_LEN;
+    parse_trace(p, base + len, 1);
+    flush_batch();
+    munmap((void *)base, len);
+    return 0;
+}
+
+/*
+*   replay a pipe through a fixed buffer; the tail of a record cut by
+*   read() is moved to the front before refilling
+*/
+int replay_stream()
+{
+    char *ring = (char*)malloc(RING_SIZE);
+    size_t fill = 0;
+    ssize_t n = 1;
+
+    // the format is known once the magic could have arrived
+    while (fill < TRACE_MAGIC_LEN && (n = read(fd, ring + fill, RING_SIZE - fill)) > 0)
+        fill += n;
+    if ((binary_trace = trace_is_binary(ring, fill))) {
+        fill -= TRACE_MAGIC_LEN;
+        memmove(ring, ring + TRACE_MAGIC_LEN, fill);
+    }
+
+    while (n > 0) {
+        const char *rest = parse_trace(ring, ring + fill, fill == RING_SIZE);
+        fill = ring + fill - rest;
+        memmove(ring, rest, fill);
+        if ((n = read(fd, ring + fill, RING_SIZE - fill)) > 0)
+            fill += n;
     }
-    
-    // no invalid cache line, try to evict one according to timestamp
-    ++eviction_count;
-    cache[set][oldest_pos].valid = 1;
-    cache[set][oldest_pos].tag = tag;
-    cache[set][oldest_pos].timeStamp = curTime++;
+    parse_trace(ring, ring + fill, 1);
+    flush_batch();
+    free(ring);
+    return n < 0 ? -1 : 0;
 }
 
 int main(int argc, char **argv)
@@ -135,11 +1230,9 @@ int main(int argc, char **argv)
     int ch;
     memset(t, 0, MAX_FILENAME_LENGTH);
     verbose = s = E = b = 0;
-    hit_count = miss_count = eviction_count = 0;
-    curTime = 0;
 
     // parse arguments
-    while ((ch = getopt(argc, argv, "hvs:E:b:t:")) != -1) {
+    while ((ch = getopt(argc, argv, "hvs:E:b:t:p:l:w:mj:")) != -1) {
         switch (ch) {
             case 'h':
                 usage();
@@ -149,13 +1242,60 @@ int main(int argc, char **argv)
                 usage();
                 break;
             case 's':
-                s = atoi(optarg);
+                if (parse_list(optarg, sweep_s, &n_s, 0) < 0) {
+                    printf("Bad value for -s: %s\n", optarg);
+                    return -1;
+                }
+                s = sweep_s[0];
                 break;
             case 'E':
-                E = atoi(optarg);
+                if (parse_list(optarg, sweep_E, &n_E, 1) < 0) {
+                    printf("Bad value for -E: %s\n", optarg);
+                    return -1;
+                }
+                E = sweep_E[0];
                 break;
             case 'b':
-                b = atoi(optarg);
+                if (parse_list(optarg, sweep_b, &n_b, 0) < 0) {
+                    printf("Bad value for -b: %s\n", optarg);
+                    return -1;
+                }
+                b = sweep_b[0];
+                break;
+            case 'p':
+                for (policy = 0; policy < NUM_POLICIES; ++policy)
+                    if (!strcmp(optarg, policy_names[policy]))
+                        break;
+                if (policy == NUM_POLICIES) {
+                    printf("Unknown policy %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'w':
+                if (!strcmp(optarg, "allocate"))
+                    write_allocate = 1;
+                else if (!strcmp(optarg, "noallocate"))
+                    write_allocate = 0;
+                else {
+                    printf("Unknown write mode %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                report_traffic = 1;
+                break;
+            case 'j':
+                n_threads = atoi(optarg);
+                if (n_threads <= 0) {
+                    printf("Bad thread count %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                if (add_level(optarg) < 0) {
+                    printf("Bad cache level %s.\n", optarg);
+                    return -1;
+                }
                 break;
             case 't':
                 if (strlen(optarg) > MAX_FILENAME_LENGTH - 1) {
@@ -168,43 +1308,80 @@ int main(int argc, char **argv)
                 break;
         }
     }
-    if (!s || !E || !b || !t[0]) {
+    if ((!n_levels && (!s || !E || !b)) || !t[0]) {
         printf("Too few arguments.\n");
         return -1;
     }
+    if (n_levels && n_threads) {
+        printf("-j does not apply to a hierarchy (-l).\n");
+        return -1;
+    }
+    int sweep = n_s > 1 || n_E > 1 || n_b > 1;
+    if (policy == POLICY_PLRU)
+        for (int k = 0; k < n_E; ++k)
+            if (sweep_E[k] > 64 || (sweep_E[k] & (sweep_E[k] - 1))) {
+                printf("PLRU needs E to be a power of two up to 64.\n");
+                return -1;
+            }
     S = 1 << s;
     if (verbose)
         printf("set_num: %d\n", S);
-    file = fopen(t, "r");
-    if (!file) {
+    fd = strcmp(t, "-") ? open(t, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
         printf("Fail to open %s", t);
         return -1;
     }
 
-    init_cache();
-
-    char op;
-    addr_t addr;
-    uint64_t size;
+    init_find_way();
+    if (n_levels) {
+        start_levels();
+        replay = replay_levels;
+    } else if (sweep) {
+        verbose = 0;
+        start_sweep();
+        replay = publish_batch;
+    } else {
+        init_cache(&cache, s, E, b, policy);
+        if (n_threads > 1) {
+            verbose = 0;
+            start_shards();
+            replay = replay_sharded;
+        }
+    }
 
     // parse memory change history
-    while (fscanf(file, " %c %lx,%ld\n", &op, &addr, &size) > 0) {
-        if (verbose)
-            printf("op:%c, addr:%lx, size:%ld\n", op, addr, size);
-        switch (op) {
-            case 'M':
-                access_mem(addr);
-            case 'L':
-            case 'S':
-                access_mem(addr);
-            default:
-                break;
-        }
+    struct stat st;
+    int ret;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        replay_mapped(st.st_size) == 0)
+        ret = 0;
+    else
+        ret = replay_stream();
+    if (ret < 0) {
+        printf("Fail to read %s\n", t);
+        return -1;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    if (n_levels) {
+        print_levels();
+        return 0;
+    }
+    if (sweep) {
+        stop_workers();
+        print_sweep();
+        return 0;
     }
 
-    free_cache();
-    fclose(file);
-    
-    printSummary(hit_count, miss_count, eviction_count);
+    if (shards)
+        finish_shards();
+    free_cache(&cache);
+    printSummary(cache.hit_count, cache.miss_count, cache.eviction_count);
+    if (report_traffic) {
+        printf("dirty evictions:%d\n", cache.writeback_count);
+        print_traffic(cache.read_bytes, cache.write_bytes,
+                      cache.hit_count + cache.miss_count);
+    }
     return 0;
 }
@@ -0,0 +1,124 @@
+/*
+ * traceconv.c - Convert memory traces between the valgrind lackey text
+ *     format and the compact binary format described in tracefmt.h.
+ *
+ *     linux> ./traceconv -e traces/long.trace > long.bt
+ *     linux> ./traceconv -d long.bt > long.trace
+ *
+ * Without a file name the trace is read from stdin, so a lackey run can
+ * be piped straight in. The output always goes to stdout.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "tracefmt.h"
+
+#define BUF_SIZE (1 << 16)
+
+/*
+ * encode - Text records from in become binary records on out.
+ *     Lines that are not records are dropped.
+ */
+static void encode(FILE *in, FILE *out)
+{
+    char line[1000];
+    uint8_t rec[TRACE_MAX_RECORD];
+    uint64_t prev = 0, addr;
+    uint32_t size;
+    char op;
+
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, out);
+    while (fgets(line, sizeof(line), in)) {
+        if (!trace_parse_line(line, line + strlen(line), &op, &addr, &size))
+            continue;
+        fwrite(rec, 1, trace_encode(rec, &prev, op, addr, size) - rec, out);
+    }
+}
+
+/*
+ * decode - Binary records from in become lackey text lines on out
+ */
+static int decode(FILE *in, FILE *out)
+{
+    static uint8_t buf[BUF_SIZE];
+    size_t fill, n;
+    uint64_t prev = 0, addr;
+    uint32_t size;
+    char op;
+
+    fill = fread(buf, 1, BUF_SIZE, in);
+    if (!trace_is_binary(buf, fill)) {
+        fprintf(stderr, "traceconv: input is not a binary trace\n");
+        return 1;
+    }
+    const uint8_t *p = buf + TRACE_MAGIC_LEN, *next;
+    for (;;) {
+        while ((next = trace_decode(p, buf + fill, &prev, &op, &addr, &size))) {
+            trace_format_line(out, op, addr, size);
+            p = next;
+        }
+        /* Keep the cut record and refill behind it */
+        fill = buf + fill - p;
+        memmove(buf, p, fill);
+        p = buf;
+        n = fread(buf + fill, 1, BUF_SIZE - fill, in);
+        if (n == 0)
+            break;
+        fill += n;
+    }
+    if (fill) {
+        fprintf(stderr, "traceconv: trailing partial record\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(char *argv[])
+{
+    printf("Usage: %s [-h] -e|-d [file]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h   Print this help message.\n");
+    printf("  -e   Encode a lackey text trace into the binary format.\n");
+    printf("  -d   Decode a binary trace into lackey text.\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int c, mode = 0, ret;
+    FILE *in = stdin;
+
+    while ((c = getopt(argc, argv, "edh")) != -1) {
+        switch (c) {
+        case 'e':
+        case 'd':
+            mode = c;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+    if (!mode) {
+        usage(argv);
+        exit(1);
+    }
+    if (optind < argc && !(in = fopen(argv[optind], "r"))) {
+        fprintf(stderr, "traceconv: cannot open %s\n", argv[optind]);
+        exit(1);
+    }
+
+    ret = 0;
+    if (mode == 'e')
+        encode(in, stdout);
+    else
+        ret = decode(in, stdout);
+
+    if (in != stdin)
+        fclose(in);
+    return ret;
+}
@@ -0,0 +1,166 @@
+/*
+ * tracefmt.h - Memory trace formats shared by csim, test-trans and
+ *     traceconv.
+ *
+ * A text trace is valgrind lackey output, one access per line:
+ *     "I  0400d7d4,8"     instruction fetch
+ *     " L 7ff0005b8,8"    load, likewise S for store and M for modify
+ *
+ * A binary trace starts with TRACE_MAGIC, followed by one record per
+ * access:
+ *     head byte   op in bits 0-1 (I, L, S, M), size in bits 2-7; a
+ *                 size of TRACE_SIZE_ESC means the size follows as a
+ *                 varint
+ *     varint      zigzag encoded difference from the previous address
+ * Varints are little-endian base 128. Neighbouring accesses are close
+ * together, so most records take two or three bytes.
+ */
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "CSIMTRC1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_SIZE_ESC 63
+#define TRACE_MAX_RECORD 16     /* head byte plus two varints */
+
+/*
+ * trace_is_binary - Does the buffer start with the binary trace magic?
+ */
+static inline int trace_is_binary(const void *p, size_t len)
+{
+    return len >= TRACE_MAGIC_LEN && !memcmp(p, TRACE_MAGIC, TRACE_MAGIC_LEN);
+}
+
+static inline int trace_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * trace_parse_line - Parse one text line in [p, nl). Returns 1 and
+ *     fills op, addr and size for an access record, 0 for anything else
+ *     (valgrind banners, blank lines).
+ */
+static inline int trace_parse_line(const char *p, const char *nl,
+                                   char *op, uint64_t *addr, uint32_t *size)
+{
+    while (p < nl && (*p == ' ' || *p == '\t'))
+        ++p;
+    if (p == nl)
+        return 0;
+    *op = *p++;
+    if (*op != 'I' && *op != 'L' && *op != 'S' && *op != 'M')
+        return 0;
+    while (p < nl && *p == ' ')
+        ++p;
+
+    uint64_t a = 0;
+    int d, digits = 0;
+    while (p < nl && (d = trace_hex_digit(*p)) >= 0) {
+        a = a << 4 | d;
+        ++p;
+        ++digits;
+    }
+    uint32_t sz = 0;
+    if (p < nl && *p == ',')
+        for (++p; p < nl && *p >= '0' && *p <= '9'; ++p)
+            sz = sz * 10 + (*p - '0');
+    *addr = a;
+    *size = sz;
+    return digits > 0;
+}
+
+/*
+ * trace_format_line - Print one record the way lackey does
+ */
+static inline void trace_format_line(FILE *fp, char op, uint64_t addr,
+                                     uint32_t size)
+{
+    if (op == 'I')
+        fprintf(fp, "I  %08lx,%u\n", (unsigned long)addr, size);
+    else
+        fprintf(fp, " %c %08lx,%u\n", op, (unsigned long)addr, size);
+}
+
+static inline uint8_t *trace_put_varint(uint8_t *out, uint64_t v)
+{
+    while (v >= 0x80) {
+        *out++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *out++ = (uint8_t)v;
+    return out;
+}
+
+static inline const uint8_t *trace_get_varint(const uint8_t *p,
+                                              const uint8_t *end, uint64_t *v)
+{
+    uint64_t r = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        r |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = r;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * trace_encode - Append one binary record to out, which must have room
+ *     for TRACE_MAX_RECORD bytes. prev is the previous address, and is
+ *     updated. Returns the end of the record.
+ */
+static inline uint8_t *trace_encode(uint8_t *out, uint64_t *prev,
+                                    char op, uint64_t addr, uint32_t size)
+{
+    int code = op == 'L' ? 1 : op == 'S' ? 2 : op == 'M' ? 3 : 0;
+    int64_t delta = (int64_t)(addr - *prev);
+    *prev = addr;
+
+    if (size < TRACE_SIZE_ESC) {
+        *out++ = (uint8_t)(code | size << 2);
+    } else {
+        *out++ = (uint8_t)(code | TRACE_SIZE_ESC << 2);
+        out = trace_put_varint(out, size);
+    }
+    return trace_put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+/*
+ * trace_decode - Read one binary record from [p, end). Returns the
+ *     start of the next record, or NULL if the record is cut short.
+ */
+static inline const uint8_t *trace_decode(const uint8_t *p, const uint8_t *end,
+                                          uint64_t *prev, char *op,
+                                          uint64_t *addr, uint32_t *size)
+{
+    if (p >= end)
+        return NULL;
+    uint8_t head = *p++;
+    uint64_t v;
+    *op = "ILSM"[head & 3];
+    *size = head >> 2;
+    if (*size == TRACE_SIZE_ESC) {
+        if (!(p = trace_get_varint(p, end, &v)))
+            return NULL;
+        *size = (uint32_t)v;
+    }
+    if (!(p = trace_get_varint(p, end, &v)))
+        return NULL;
+    *prev += (v >> 1) ^ -(v & 1);
+    *addr = *prev;
+    return p;
+}
+
+#endif /* TRACEFMT_H */
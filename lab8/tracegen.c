@@ -5,6 +5,10 @@
  * The beginning and end of each registered transpose function's trace
  * is indicated by reading from "marker" addresses. These two marker
  * addresses are recorded in file for later use.
+ *
+ * With -L, tracegen prints where the markers, the matrices, M, N and
+ * func_list are instead, so that test-trans can trace in-process at
+ * addresses that match these.
  */
 
 #include <stdlib.h>
@@ -19,6 +23,9 @@
 extern trans_func_t func_list[MAX_TRANS_FUNCS];
 extern int func_counter; 
 
+/* Start of this program's image (GNU ld) */
+extern char __executable_start;
+
 /* External function from trans.c */
 extern void registerFunctions();
 
@@ -51,7 +58,7 @@ int main(int argc, char* argv[]){
 
     char c;
     int selectedFunc=-1;
-    while( (c=getopt(argc,argv,"M:N:F:")) != -1){
+    while( (c=getopt(argc,argv,"M:N:F:L")) != -1){
         switch(c){
         case 'M':
             M = atoi(optarg);
@@ -62,6 +69,17 @@ int main(int argc, char* argv[]){
         case 'F':
             selectedFunc = atoi(optarg);
             break;
+        case 'L':
+            printf("%llx %llx %llx %llx %llx %llx %llx %llx\n",
+                   (unsigned long long int) &__executable_start,
+                   (unsigned long long int) &MARKER_START,
+                   (unsigned long long int) &MARKER_END,
+                   (unsigned long long int) A,
+                   (unsigned long long int) B,
+                   (unsigned long long int) &M,
+                   (unsigned long long int) &N,
+                   (unsigned long long int) func_list);
+            exit(0);
         case '?':
         default:
             printf("./tracegen failed to parse its options.\n");
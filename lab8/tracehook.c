@@ -0,0 +1,68 @@
+/*
+ * tracehook.c - Load/store hooks called by code compiled with
+ *     -fsanitize=thread, see tracehook.h
+ */
+#define _GNU_SOURCE     /* for pthread_getattr_np */
+#include <pthread.h>
+#include "tracehook.h"
+
+/* Per thread, so test-trans can trace several functions at once */
+static __thread unsigned long long stack_lo, stack_hi;
+static __thread trace_sink_t trace_sink;
+static __thread void *trace_ctx;
+
+void trace_start(trace_sink_t sink, void *ctx)
+{
+    pthread_attr_t attr;
+    void *base;
+    size_t size;
+
+    if (!stack_hi) {
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &base, &size);
+        pthread_attr_destroy(&attr);
+        stack_lo = (unsigned long long)base;
+        stack_hi = stack_lo + size;
+    }
+    trace_ctx = ctx;
+    trace_sink = sink;
+}
+
+void trace_stop(void)
+{
+    trace_sink = 0;
+}
+
+static inline void record(char op, const void *p, unsigned int size)
+{
+    unsigned long long addr = (unsigned long long)p;
+    if (trace_sink && (addr < stack_lo || addr >= stack_hi))
+        trace_sink(trace_ctx, op, addr, size);
+}
+
+void trace_stream(const void *p, unsigned int size)
+{
+    record('N', p, size);
+}
+
+/* The instrumentation interface; these take the place of libtsan */
+void __tsan_init(void) {}
+void __tsan_func_entry(void *pc) {}
+void __tsan_func_exit(void) {}
+
+#define HOOKS(n)                                                           \
+    void __tsan_read##n(void *p) { record('L', p, n); }                    \
+    void __tsan_write##n(void *p) { record('S', p, n); }                   \
+    void __tsan_unaligned_read##n(void *p) { record('L', p, n); }          \
+    void __tsan_unaligned_write##n(void *p) { record('S', p, n); }         \
+    void __tsan_volatile_read##n(void *p) { record('L', p, n); }           \
+    void __tsan_volatile_write##n(void *p) { record('S', p, n); }
+
+HOOKS(1)
+HOOKS(2)
+HOOKS(4)
+HOOKS(8)
+HOOKS(16)
+
+void __tsan_read_range(void *p, unsigned long size) { record('L', p, size); }
+void __tsan_write_range(void *p, unsigned long size) { record('S', p, size); }
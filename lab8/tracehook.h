@@ -0,0 +1,30 @@
+/*
+ * tracehook.h - In-process memory tracing for the transpose functions.
+ *
+ * trans.c is compiled a second time with -fsanitize=thread, which makes
+ * the compiler call a __tsan_readN/__tsan_writeN hook before every load
+ * and store that is not to a private stack variable. tracehook.c defines
+ * those hooks itself (the sanitizer runtime is never linked) and passes
+ * the accesses that are not to the calling thread's stack on to a sink,
+ * in program order. That is what test-trans -V keeps of valgrind's trace,
+ * which drops everything above the low 4GB, where valgrind puts the
+ * stack.
+ */
+#ifndef TRACEHOOK_H
+#define TRACEHOOK_H
+
+typedef void (*trace_sink_t)(void *ctx, char op, unsigned long long addr,
+                             unsigned int size);
+
+/* Report every access the calling thread makes off its own stack to
+   sink until it calls trace_stop() */
+void trace_start(trace_sink_t sink, void *ctx);
+
+void trace_stop(void);
+
+/* Report a non-temporal store of size bytes at p, as op N. The compiler
+   does not instrument the streaming store intrinsics, so code built
+   with the hooks calls this itself. */
+void trace_stream(const void *p, unsigned int size);
+
+#endif /* TRACEHOOK_H */
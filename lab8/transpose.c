@@ -0,0 +1,355 @@
+/*
+ * transpose.c - Blocked, cache-oblivious and autotuned transpose, see
+ *     transpose.h
+ *
+ * Every strategy is a walk over tiles of A. The same walk either moves
+ * the data or, for the autotuner, feeds the addresses the tile code
+ * would touch into a cache model, so the tuner always measures exactly
+ * the code that later runs.
+ */
+#include <stdint.h>
+#include <immintrin.h>
+#include "cachelab.h"
+#include "cachemodel.h"
+#include "transpose.h"
+
+/* The copy built with trace hooks reports the streaming stores itself */
+#ifdef __SANITIZE_THREAD__
+#include "tracehook.h"
+#define TRACE_STREAM(p, n) trace_stream(p, n)
+#else
+#define TRACE_STREAM(p, n)
+#endif
+
+#define KERNEL 8                    /* side of the register kernel */
+#define STREAM_BYTES (8 << 20)      /* B this large bypasses the cache */
+#define TUNE_MAXN 512               /* the tuner looks at this corner */
+#define MAX_PLANS 16
+
+/* The autotuner's cache, by default the 1KB direct mapped one of the lab */
+static int tune_s = 5, tune_E = 1, tune_b = 5;
+
+/* Plans found so far, replaced round robin; each thread keeps its own */
+static __thread transpose_plan_t plans[MAX_PLANS];
+static __thread int n_plans, next_plan;
+
+/* One walk over the matrices */
+typedef struct pass {
+    const int *A;
+    int *B;
+    int M, N;
+    int avx2;               /* use the AVX2 kernel for full tiles */
+    int rows;               /* rows of A in a full tile, 16 to stream */
+    cache_model_t *model;   /* if set, only simulate the accesses */
+} pass_t;
+
+/*
+ * kernel_load - Load one 8x8 tile into eight ymm registers, transposed.
+ *     Rows are interleaved in pairs of ints, then pairs of pairs, and
+ *     the 128-bit halves are finally swapped across registers.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline void kernel_load(const int *a, int lda, __m256i r[KERNEL])
+{
+    __m256i t[KERNEL], u[KERNEL];
+    int k;
+
+    for (k = 0; k < KERNEL; k++)
+        r[k] = _mm256_loadu_si256((const __m256i *)(a + (long)k * lda));
+
+    for (k = 0; k < KERNEL; k += 2) {
+        t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+        t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+    }
+    for (k = 0; k < KERNEL; k += 4) {
+        u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+        u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+        u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+        u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+    }
+    for (k = 0; k < 4; k++) {
+        r[k] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+        r[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+    }
+}
+
+/*
+ * kernel_avx2 - Transpose one 8x8 tile
+ */
+__attribute__((target("avx2")))
+static void kernel_avx2(const int *a, int lda, int *b, int ldb)
+{
+    __m256i r[KERNEL];
+    int k;
+
+    kernel_load(a, lda, r);
+    for (k = 0; k < KERNEL; k++)
+        _mm256_storeu_si256((__m256i *)(b + (long)k * ldb), r[k]);
+}
+
+/*
+ * kernel_avx2_stream - Transpose a 16x8 tile, writing each row of B as
+ *     one whole 64 byte line around the cache. Half lines would make
+ *     the streaming stores slower than ordinary ones.
+ */
+__attribute__((target("avx2")))
+static void kernel_avx2_stream(const int *a, int lda, int *b, int ldb)
+{
+    __m256i lo[KERNEL], hi[KERNEL];
+    int k;
+
+    kernel_load(a, lda, lo);
+    kernel_load(a + (long)KERNEL * lda, lda, hi);
+    for (k = 0; k < KERNEL; k++) {
+        _mm256_stream_si256((__m256i *)(b + (long)k * ldb), lo[k]);
+        TRACE_STREAM(b + (long)k * ldb, sizeof(__m256i));
+        _mm256_stream_si256((__m256i *)(b + (long)k * ldb + KERNEL), hi[k]);
+        TRACE_STREAM(b + (long)k * ldb + KERNEL, sizeof(__m256i));
+    }
+}
+
+/*
+ * model_kernel - Feed the model what a kernel call does: rows rows of
+ *     KERNEL ints loaded from a, then KERNEL rows of rows ints stored to
+ *     b with op, one access for every block each row touches
+ */
+static void model_kernel(cache_model_t *m, const int *a, int lda, int *b,
+                         int ldb, int rows, char op)
+{
+    uintptr_t block = (uintptr_t)1 << m->b;
+    uintptr_t addr, end;
+    int k;
+
+    for (k = 0; k < rows; k++) {
+        addr = (uintptr_t)(a + (long)k * lda) & ~(block - 1);
+        end = (uintptr_t)(a + (long)k * lda + KERNEL);
+        for (; addr < end; addr += block)
+            cache_model_access(m, 'L', addr);
+    }
+    for (k = 0; k < KERNEL; k++) {
+        addr = (uintptr_t)(b + (long)k * ldb) & ~(block - 1);
+        end = (uintptr_t)(b + (long)k * ldb + rows);
+        for (; addr < end; addr += block)
+            cache_model_access(m, op, addr);
+    }
+}
+
+/*
+ * tile - Transpose rows [i0, i1) and columns [j0, j1) of A
+ */
+static void tile(const pass_t *p, int i0, int i1, int j0, int j1)
+{
+    const int *a = p->A + (long)i0 * p->M + j0;
+    int *b = p->B + (long)j0 * p->N + i0;
+    int i, j;
+
+    if (p->avx2 && j1 - j0 == KERNEL && i1 - i0 == KERNEL) {
+        if (p->model)
+            model_kernel(p->model, a, p->M, b, p->N, KERNEL, 'S');
+        else
+            kernel_avx2(a, p->M, b, p->N);
+        return;
+    }
+    if (p->avx2 && j1 - j0 == KERNEL && i1 - i0 == 2 * KERNEL) {
+        if (!(((uintptr_t)b | (uintptr_t)p->N * sizeof(int)) & 63)) {
+            if (p->model)
+                model_kernel(p->model, a, p->M, b, p->N, 2 * KERNEL, 'N');
+            else
+                kernel_avx2_stream(a, p->M, b, p->N);
+        } else if (p->model) {
+            model_kernel(p->model, a, p->M, b, p->N, KERNEL, 'S');
+            model_kernel(p->model, a + (long)KERNEL * p->M, p->M,
+                         b + KERNEL, p->N, KERNEL, 'S');
+        } else {
+            kernel_avx2(a, p->M, b, p->N);
+            kernel_avx2(a + (long)KERNEL * p->M, p->M, b + KERNEL, p->N);
+        }
+        return;
+    }
+
+    for (i = 0; i < i1 - i0; i++) {
+        for (j = 0; j < j1 - j0; j++) {
+            if (p->model) {
+                cache_model_access(p->model, 'L',
+                                   (uintptr_t)(a + (long)i * p->M + j));
+                cache_model_access(p->model, 'S',
+                                   (uintptr_t)(b + (long)j * p->N + i));
+            } else {
+                b[(long)j * p->N + i] = a[(long)i * p->M + j];
+            }
+        }
+    }
+}
+
+/*
+ * walk_blocked - Visit block x block squares row by row; squares large
+ *     enough are cut into full tiles
+ */
+static void walk_blocked(const pass_t *p, int rows, int cols, int block)
+{
+    int istep = block >= p->rows ? p->rows : block;
+    int jstep = block >= KERNEL ? KERNEL : block;
+    int i0, j0, i, j;
+
+    for (i0 = 0; i0 < rows; i0 += block)
+        for (j0 = 0; j0 < cols; j0 += block)
+            for (i = i0; i < i0 + block && i < rows; i += istep)
+                for (j = j0; j < j0 + block && j < cols; j += jstep)
+                    tile(p, i, i + istep < rows ? i + istep : rows,
+                         j, j + jstep < cols ? j + jstep : cols);
+}
+
+/*
+ * walk_oblivious - Halve the longer side until the piece fits a tile.
+ *     Cuts fall on multiples of the tile size, so all inner tiles are
+ *     full ones.
+ */
+static void walk_oblivious(const pass_t *p, int i0, int i1, int j0, int j1)
+{
+    int half;
+
+    if (i1 - i0 <= p->rows && j1 - j0 <= KERNEL) {
+        tile(p, i0, i1, j0, j1);
+    } else if (i1 - i0 > p->rows && i1 - i0 >= j1 - j0) {
+        half = ((i1 - i0) / 2 + p->rows - 1) & ~(p->rows - 1);
+        walk_oblivious(p, i0, i0 + half, j0, j1);
+        walk_oblivious(p, i0 + half, i1, j0, j1);
+    } else {
+        half = ((j1 - j0) / 2 + KERNEL - 1) & ~(KERNEL - 1);
+        walk_oblivious(p, i0, i1, j0, j0 + half);
+        walk_oblivious(p, i0, i1, j0 + half, j1);
+    }
+}
+
+static void walk(const pass_t *p, int rows, int cols, int block)
+{
+    if (block == TRANSPOSE_OBLIVIOUS)
+        walk_oblivious(p, 0, rows, 0, cols);
+    else
+        walk_blocked(p, rows, cols, block);
+}
+
+static void init_pass(pass_t *p, int M, int N, const int *A, int *B)
+{
+    p->A = A;
+    p->B = B;
+    p->M = M;
+    p->N = N;
+    p->avx2 = __builtin_cpu_supports("avx2") != 0;
+    p->rows = (long)M * N * sizeof(int) >= STREAM_BYTES ? 2 * KERNEL : KERNEL;
+    p->model = 0;
+}
+
+/*
+ * run - Transpose for real with the given block size
+ */
+static void run(int M, int N, const int *A, int *B, int block)
+{
+    pass_t p;
+
+    init_pass(&p, M, N, A, B);
+    walk(&p, N, M, block);
+    if (p.rows > KERNEL)
+        _mm_sfence();
+}
+
+/*
+ * transpose_set_cache - Change the modelled cache. Plans made for the old
+ *     one are dropped; call it before starting other threads.
+ */
+void transpose_set_cache(int s, int E, int b)
+{
+    tune_s = s;
+    tune_E = E;
+    tune_b = b;
+    n_plans = next_plan = 0;
+}
+
+/*
+ * transpose_tune - Simulate every candidate on the top left corner of
+ *     the matrices, at most TUNE_MAXN square, and keep the cheapest.
+ *     The oblivious strategy comes first, so it wins ties.
+ */
+transpose_plan_t transpose_tune(int M, int N, const int *A, const int *B)
+{
+    static const int blocks[] = TRANSPOSE_BLOCKS;
+    transpose_plan_t best = { M, N, TRANSPOSE_OBLIVIOUS, ~0u };
+    cache_model_t model;
+    pass_t p;
+    unsigned int i;
+
+    init_pass(&p, M, N, A, (int *)B);
+    p.model = &model;
+    cache_model_init(&model, tune_s, tune_E, tune_b);
+    for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        if (blocks[i] > M && blocks[i] > N)
+            break;
+        cache_model_reset(&model);
+        walk(&p, N < TUNE_MAXN ? N : TUNE_MAXN,
+             M < TUNE_MAXN ? M : TUNE_MAXN, blocks[i]);
+        if (model.misses < best.misses) {
+            best.block = blocks[i];
+            best.misses = model.misses;
+        }
+    }
+    cache_model_free(&model);
+    return best;
+}
+
+void transpose_blocked(int M, int N, const int *A, int *B, int block)
+{
+    run(M, N, A, B, block > 0 ? block : KERNEL);
+}
+
+void transpose_oblivious(int M, int N, const int *A, int *B)
+{
+    run(M, N, A, B, TRANSPOSE_OBLIVIOUS);
+}
+
+/*
+ * transpose_auto - Look up or make the plan for this shape and run it
+ */
+void transpose_auto(int M, int N, const int *A, int *B)
+{
+    int i;
+
+    for (i = 0; i < n_plans; i++)
+        if (plans[i].M == M && plans[i].N == N)
+            break;
+    if (i == n_plans) {
+        i = next_plan;
+        next_plan = (next_plan + 1) % MAX_PLANS;
+        if (n_plans < MAX_PLANS)
+            n_plans++;
+        plans[i] = transpose_tune(M, N, A, B);
+    }
+    run(M, N, A, B, plans[i].block);
+}
+
+/*
+ * Adapters to the driver's transpose function prototype
+ */
+static char auto_desc[] = "Autotuned transpose";
+static void auto_trans(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_auto(M, N, &A[0][0], &B[0][0]);
+}
+
+static char oblivious_desc[] = "Cache-oblivious recursive transpose";
+static void oblivious_trans(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_oblivious(M, N, &A[0][0], &B[0][0]);
+}
+
+static char blocked_desc[] = "Blocked 8x8 transpose";
+static void blocked_trans(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_blocked(M, N, &A[0][0], &B[0][0], KERNEL);
+}
+
+void transpose_register(void)
+{
+    registerTransFunction(auto_trans, auto_desc);
+    registerTransFunction(oblivious_trans, oblivious_desc);
+    registerTransFunction(blocked_trans, blocked_desc);
+}
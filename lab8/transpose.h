@@ -0,0 +1,49 @@
+/*
+ * transpose.h - A general B = A^T engine for int matrices of any shape.
+ *
+ * A is N rows of M ints and B is M rows of N ints, both stored row by
+ * row without padding, as in the transpose functions of trans.c.
+ *
+ * Three strategies are offered:
+ *     blocked     square tiles of a fixed size
+ *     oblivious   recursive halving of the longer side down to 8x8
+ *                 tiles, which suits every cache level without tuning
+ *     auto        whichever of the above the autotuner picks for the
+ *                 shape
+ * Full 8x8 tiles are transposed in AVX2 registers when the CPU has it,
+ * and for matrices much larger than the cache that kernel writes B with
+ * non-temporal stores.
+ *
+ * The autotuner replays each strategy's access pattern, without moving
+ * any data, through the cache model of cachemodel.h and keeps the one
+ * with the fewest misses. Plans are remembered per shape, separately in
+ * each thread, so the functions are safe to call concurrently.
+ */
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+/* Block sizes the autotuner tries; 0 stands for the oblivious strategy */
+#define TRANSPOSE_OBLIVIOUS 0
+#define TRANSPOSE_BLOCKS { TRANSPOSE_OBLIVIOUS, 4, 8, 16, 32, 64 }
+
+typedef struct transpose_plan {
+    int M, N;
+    int block;              /* tile size, or TRANSPOSE_OBLIVIOUS */
+    unsigned int misses;    /* simulated misses of the chosen plan */
+} transpose_plan_t;
+
+/* Set the cache the autotuner models; the default is the graded one */
+void transpose_set_cache(int s, int E, int b);
+
+/* Find the best plan for transposing A into B */
+transpose_plan_t transpose_tune(int M, int N, const int *A, const int *B);
+
+void transpose_blocked(int M, int N, const int *A, int *B, int block);
+void transpose_oblivious(int M, int N, const int *A, int *B);
+void transpose_auto(int M, int N, const int *A, int *B);
+
+/* Register the strategies with the driver via registerTransFunction;
+   test-trans -B does, to time them next to the ones of trans.c */
+void transpose_register(void);
+
+#endif /* TRANSPOSE_H */